@@ -1,104 +1,227 @@
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "allocator.h"
+#include "block_move.h"
+#include "sampler.h"
+#include "thread_pool.h"
 
 
-Pointer::Pointer() {
-    p = std::shared_ptr<void *>(new void *(nullptr));
-    p_size = std::shared_ptr<size_t>(new size_t(0));
+Pointer::Pointer(void *p, size_t size, AllocHint hint, bool atomic_refs) {
+    cell = new PointerCell(p, size, hint, atomic_refs);
 }
 
 
-Pointer::Pointer(void **_p, size_t *_p_size) {
-    p = std::shared_ptr<void *>(_p);
-    p_size = std::shared_ptr<size_t>(_p_size);
+EpochDomain::EpochDomain() {
+    for (size_t i = 0; i < max_readers; ++i) {
+        readers[i].used = false;
+        readers[i].epoch = 0;
+    }
+    reader_count = 0;
+    global_epoch = 1;
+}
+
+
+uint64_t EpochDomain::safeEpoch() const {
+    uint64_t oldest = UINT64_MAX;
+
+    for (size_t i = 0; i < max_readers; ++i) {
+        uint64_t epoch = readers[i].epoch.load();
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+    return oldest;
+}
+
+
+int EpochDomain::registerReader() {
+    for (size_t i = 0; i < max_readers; ++i) {
+        bool expected = false;
+        if (readers[i].used.compare_exchange_strong(expected, true)) {
+            reader_count++;
+            return (int) i;
+        }
+    }
+    throw AllocError(AllocErrorType::NoReaderSlot, "No reader slot\n");
+}
+
+
+void EpochDomain::unregisterReader(int id) {
+    readers[id].epoch = 0;
+    readers[id].used = false;
+    reader_count--;
 }
 
 
-Allocator::Allocator(void *base, size_t size) {
+template <class Placement>
+BasicAllocator<Placement>::BasicAllocator(void *base, size_t size, size_t _large_threshold) {
     memory = base;
     ocupation = std::vector<bool>(size, false);
+    placement.reset(ocupation);
+    bytes_moved = 0;
+    large_threshold = _large_threshold;
+    thread_confined = false;
+    sampler = nullptr;
+    reclaim_batch = 64;
 }
 
 
-int Allocator::find_pointer(Pointer &p) {
-    int i;
+static size_t map_size(size_t N) {
+    static const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (N + page - 1) / page * page;
+}
+
 
-    for (i = 0; i < pointers.size(); ++i)
-        if (p.get() == (*pointers[i]).get() and p.getSize() == p.getSize())
-            break;
-    if (i == pointers.size())
-        i = -1;
+// Large blocks bypass the occupancy map and live in their own mapping.
+template <class Placement>
+Pointer BasicAllocator<Placement>::alloc_large(size_t N, AllocHint hint) {
+    void *mem = mmap(nullptr, map_size(N), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        throw AllocError(AllocErrorType::NoMemory, "No memory\n");
 
-    return i;
+    Pointer &pointer = pointers[mem];
+    pointer = Pointer(mem, N, hint, !thread_confined);
+
+    return pointer;
 }
 
 
-Pointer Allocator::alloc(size_t N) {
-    int p_begin = 0;
-    size_t k = N;
+// Resizes the mapping of a large block. On Linux mremap moves the pages
+// instead of copying the payload. With readers registered the old pages must
+// stay mapped, so the block is only grown in place, or copied and retired.
+template <class Placement>
+void BasicAllocator<Placement>::realloc_large(Pointer &p, size_t N) {
+    size_t old_map = map_size(p.getSize()), new_map = map_size(N);
+    bool shared = hasReaders();
 
-    for (int i = 0; i < ocupation.size(); ++i) {
-        if (ocupation[i] == false) {
-            p_begin = i;
-            k = N;
-            for (; i < ocupation.size(); ++i) {
-                if (ocupation[i] == false) k--;
-                if (ocupation[i] == true or !k) break;
-            }
-            if (!k) break;
+    if (old_map != new_map) {
+        void *mem = MAP_FAILED;
+
+        if (shared && new_map < old_map) {
+            retire((char *) p.get() + new_map, old_map - new_map);
+            mem = p.get();
         }
+#if defined(__linux__)
+        if (mem == MAP_FAILED)
+            mem = mremap(p.get(), old_map, new_map, shared ? 0 : MREMAP_MAYMOVE);
+#endif
+        if (mem == MAP_FAILED) {
+            mem = mmap(nullptr, new_map, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED)
+                throw AllocError(AllocErrorType::NoMemory, "No memory\n");
+            block_move(mem, p.get(), std::min(p.getSize(), N));
+            retire(p.get(), old_map);
+        }
+        p.set(mem);
     }
-    if (k > 0)
+    p.setSize(N);
+}
+
+
+template <class Placement>
+Pointer BasicAllocator<Placement>::alloc_arena(size_t N, AllocHint hint) {
+    size_t p_begin;
+    bool found;
+
+    bool tenured = hint != AllocHint::Short;
+
+    found = placement.find(ocupation, N, tenured, p_begin);
+    if (!found && !limbo.empty()) {
+        reclaim();
+        found = placement.find(ocupation, N, tenured, p_begin);
+    }
+
+    if (!found)
         throw AllocError(AllocErrorType::NoMemory, "No memory\n");
 
-    std::fill(ocupation.begin() + p_begin,
-              ocupation.begin() + p_begin + N, true);
+    mark_used(p_begin, N);
 
-    void **p = new (void *)((char *) memory + p_begin);
+    void *p = (char *) memory + p_begin;
 
-    Pointer *pointer = new Pointer(p, new size_t(N));
-    pointers.push_back(pointer);
+    Pointer &pointer = pointers[p];
+    pointer = Pointer(p, N, hint, !thread_confined);
 
-    return *pointer;
+    return pointer;
 }
 
 
-void Allocator::free(Pointer &p) {
-    int idx = find_pointer(p);
-    if (idx == -1)
+template <class Placement>
+Pointer BasicAllocator<Placement>::alloc(size_t N, AllocHint hint) {
+    Pointer pointer;
+
+    if (large_threshold && N >= large_threshold)
+        pointer = alloc_large(N, hint);
+    else
+        pointer = alloc_arena(N, hint);
+
+    if (sampler && sampler->shouldSample(N)) {
+        pointer.cell->sampled = true;
+        sampler->recordAlloc(pointer.cell, N);
+    }
+    return pointer;
+}
+
+
+template <class Placement>
+void BasicAllocator<Placement>::free(Pointer &p) {
+    typename PointerMap::iterator it = find_pointer(p);
+    if (it == pointers.end())
         throw AllocError(AllocErrorType::InvalidFree, "Invalid Free\n");
 
-    size_t offset = (char *) p.get() - (char *) memory;
+    if (p.cell->sampled && sampler)
+        sampler->recordFree(p.cell);
+
+    retire(p.get(), p.getSize());
+
+    pointers.erase(it);
+    p = Pointer();
+}
+
 
-    std::fill(ocupation.begin() + offset,
-              ocupation.begin() + offset + p.getSize(), false);
+template <class Placement>
+bool BasicAllocator<Placement>::lookup(void *addr, Pointer &out) {
+    typename PointerMap::iterator it = pointers.find(addr);
+    if (it == pointers.end())
+        return false;
 
-    delete pointers[idx];
-    pointers.erase(pointers.begin() + idx);
-    p = Pointer(new void *(nullptr), 0);
+    out = it->second;
+    return true;
 }
 
 
-void Allocator::realloc(Pointer &p, size_t N) {
-    int idx;
+template <class Placement>
+void BasicAllocator<Placement>::realloc(Pointer &p, size_t N) {
+    typename PointerMap::iterator it;
     size_t start;
     int required;
 
-    idx = find_pointer(p);
-    if (idx == -1) {
+    it = find_pointer(p);
+    if (it == pointers.end()) {
         p = alloc(N);
         return;
     }
 
-    if (idx != -1 and N == p.getSize()) return;
+    if (N == p.getSize()) return;
+
+    if (!in_arena(p)) {
+        realloc_large(p, N);
+        if (p.get() != it->first) {
+            pointers[p.get()] = std::move(it->second);
+            pointers.erase(it);
+        }
+        return;
+    }
 
     start = (char *) p.get() - (char *) memory + p.getSize();
     required = (int) (N - p.getSize());
 
     if (required < 0) {
-        std::fill(ocupation.begin() + start + required,
-                  ocupation.begin() + start, false);
+        retire((char *) memory + start + required, (size_t) -required);
         p.setSize(N);
         return;
     }
@@ -109,34 +232,272 @@ void Allocator::realloc(Pointer &p, size_t N) {
     }
 
     if (!required) {
-        std::fill(ocupation.begin() + start,
-                  ocupation.begin() + start + N - p.getSize(), true);
+        mark_used(start, N - p.getSize());
         p.setSize(N);
     } else {
-        Pointer new_p = alloc(N);
-        std::memcpy(new_p.get(), p.get(), p.getSize());
-        Allocator::free(p);
+        Pointer new_p = alloc(N, p.getHint());
+        block_move(new_p.get(), p.get(), p.getSize());
+        free(p);
         p = new_p;
     }
 }
 
 
-void Allocator::defrag() {
-    std::sort(pointers.begin(), pointers.end());
+// Computes where every block goes. Destinations are a prefix sum of block
+// sizes, restarted past each block that stays in place. The nursery pass
+// slides short-lived blocks down to the front of the arena around tenured
+// ones, then the tenured pass slides long-lived blocks up to the end around
+// short and permanent ones. Permanent blocks never move, so a stable tenured
+// region costs nothing to keep compact.
+template <class Placement>
+void BasicAllocator<Placement>::plan_defrag(std::vector<BlockMove> &down, std::vector<BlockMove> &up) {
+    std::vector<Pointer *> blocks;
+    for (typename PointerMap::iterator it = pointers.begin(); it != pointers.end(); ++it)
+        if (in_arena(it->first))
+            blocks.push_back(&it->second);
+
+    std::vector<size_t> dest(blocks.size());
+
+    size_t curr_pos = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        size_t offset = offset_of(*blocks[i]);
+        if (blocks[i]->getHint() != AllocHint::Short) {
+            dest[i] = offset;
+            curr_pos = offset + blocks[i]->getSize();
+            continue;
+        }
+        dest[i] = curr_pos;
+        if (dest[i] != offset)
+            down.push_back(BlockMove{blocks[i], offset, dest[i]});
+        curr_pos += blocks[i]->getSize();
+    }
+
+    curr_pos = ocupation.size();
+    for (size_t i = blocks.size(); i > 0; --i) {
+        if (blocks[i - 1]->getHint() != AllocHint::Long) {
+            curr_pos = dest[i - 1];
+            continue;
+        }
+        curr_pos -= blocks[i - 1]->getSize();
+        if (curr_pos != dest[i - 1])
+            up.push_back(BlockMove{blocks[i - 1], dest[i - 1], curr_pos});
+        dest[i - 1] = curr_pos;
+    }
+}
+
 
-    int curr_pos = 0;
-    for (int i = 0; i < pointers.size(); ++i) {
-        std::memcpy((char *)memory + curr_pos, pointers[i]->get(), pointers[i]->getSize());
-        pointers[i]->set((void *) ((char *) memory + curr_pos));
-        curr_pos += pointers[i]->getSize();
+// Executes one pass of moves. Without a pool the moves run in order. With a
+// pool they are grouped into waves: a move joins the wave after every earlier
+// move whose source its destination overwrites, so the moves of one wave
+// touch disjoint memory and run in parallel. Moves that do not overlap
+// themselves are also cut into pieces to spread a few huge blocks over all
+// threads.
+template <class Placement>
+void BasicAllocator<Placement>::run_moves(const std::vector<BlockMove> &moves, ThreadPool *pool) {
+    const size_t piece_size = 256 * 1024;
+    const size_t min_parallel = 64 * 1024;
+    char *base = (char *) memory;
+
+    for (size_t i = 0; i < moves.size(); ++i)
+        bytes_moved += moves[i].p->getSize();
+
+    if (!pool || pool->size() == 1) {
+        for (size_t i = 0; i < moves.size(); ++i)
+            block_move(base + moves[i].to, base + moves[i].from, moves[i].p->getSize());
+        return;
     }
 
-    std::fill(ocupation.begin(),
-              ocupation.begin() + curr_pos, true);
-    std::fill(ocupation.begin() + curr_pos,
-              ocupation.end(), false);
+    bool down = !moves.empty() && moves[0].to < moves[0].from;
+    std::vector<size_t> wave(moves.size(), 0);
+    size_t waves = 0;
+
+    for (size_t i = 0; i < moves.size(); ++i) {
+        size_t to_end = moves[i].to + moves[i].p->getSize();
+
+        for (size_t j = i; j > 0; --j) {
+            const BlockMove &o = moves[j - 1];
+            size_t from_end = o.from + o.p->getSize();
+
+            if (down ? from_end <= moves[i].to : o.from >= to_end)
+                break;
+            if (o.from < to_end && moves[i].to < from_end)
+                wave[i] = std::max(wave[i], wave[j - 1] + 1);
+        }
+        waves = std::max(waves, wave[i] + 1);
+    }
+
+    std::vector<std::vector<size_t>> by_wave(waves);
+    for (size_t i = 0; i < moves.size(); ++i)
+        by_wave[wave[i]].push_back(i);
+
+    struct Copy {
+        char *dst;
+        const char *src;
+        size_t n;
+    };
+
+    for (size_t w = 0; w < waves; ++w) {
+        std::vector<Copy> copies;
+        size_t total = 0;
+
+        for (size_t i : by_wave[w]) {
+            const BlockMove &m = moves[i];
+            size_t n = m.p->getSize();
+            size_t gap = m.to < m.from ? m.from - m.to : m.to - m.from;
+
+            if (gap < n) {
+                copies.push_back(Copy{base + m.to, base + m.from, n});
+            } else {
+                for (size_t off = 0; off < n; off += piece_size)
+                    copies.push_back(Copy{base + m.to + off, base + m.from + off,
+                                          std::min(piece_size, n - off)});
+            }
+            total += n;
+        }
+
+        if (total < min_parallel) {
+            for (const Copy &c : copies)
+                block_move(c.dst, c.src, c.n);
+            continue;
+        }
+
+        // Split the wave into one job per thread with roughly equal byte counts.
+        std::vector<std::function<void()>> jobs;
+        size_t target = total / pool->size() + 1;
+        size_t first = 0, bytes = 0;
+
+        for (size_t i = 0; i < copies.size(); ++i) {
+            bytes += copies[i].n;
+            if (bytes >= target || i + 1 == copies.size()) {
+                std::vector<Copy> batch(copies.begin() + first, copies.begin() + i + 1);
+                jobs.push_back([batch] {
+                    for (const Copy &c : batch)
+                        block_move(c.dst, c.src, c.n);
+                });
+                first = i + 1;
+                bytes = 0;
+            }
+        }
+        pool->run(jobs);
+    }
+}
+
+
+template <class Placement>
+void BasicAllocator<Placement>::defrag(size_t threads) {
+    reclaim();
+
+    std::vector<BlockMove> down, up;
+    plan_defrag(down, up);
+
+    if (threads > 1) {
+        ThreadPool pool(threads);
+        run_moves(down, &pool);
+        run_moves(up, &pool);
+    } else {
+        run_moves(down, nullptr);
+        run_moves(up, nullptr);
+    }
+
+    // Handle table is updated in bulk once every block is in place.
+    for (const BlockMove &m : down)
+        m.p->set((void *) ((char *) memory + m.to));
+    for (const BlockMove &m : up)
+        m.p->set((void *) ((char *) memory + m.to));
+
+    PointerMap moved;
+    for (typename PointerMap::iterator it = pointers.begin(); it != pointers.end(); ++it)
+        moved[it->second.get()] = std::move(it->second);
+    pointers.swap(moved);
+
+    std::fill(ocupation.begin(), ocupation.end(), false);
+    for (typename PointerMap::iterator it = pointers.begin(); it != pointers.end(); ++it) {
+        if (!in_arena(it->first))
+            continue;
+        size_t offset = offset_of(it->second);
+        std::fill(ocupation.begin() + offset,
+                  ocupation.begin() + offset + it->second.getSize(), true);
+    }
+    placement.reset(ocupation);
+}
+
+
+template <class Placement>
+void BasicAllocator<Placement>::mark_used(size_t offset, size_t N) {
+    std::fill(ocupation.begin() + offset, ocupation.begin() + offset + N, true);
+    placement.use(offset, N);
 }
 
+
+template <class Placement>
+void BasicAllocator<Placement>::mark_free(size_t offset, size_t N) {
+    std::fill(ocupation.begin() + offset, ocupation.begin() + offset + N, false);
+    placement.release(offset, N);
+}
+
+
+// Gives a range back right away: clears its bits in the occupancy map, or
+// unmaps it for large blocks.
+template <class Placement>
+void BasicAllocator<Placement>::release(void *addr, size_t size) {
+    if (in_arena(addr)) {
+        mark_free((char *) addr - (char *) memory, size);
+    } else {
+        munmap(addr, map_size(size));
+    }
+}
+
+
+// Releases a range, or with readers around stamps it with the current epoch
+// and parks it until reclaim() finds no reader old enough to see it.
+template <class Placement>
+void BasicAllocator<Placement>::retire(void *addr, size_t size) {
+    if (!hasReaders()) {
+        release(addr, size);
+        return;
+    }
+
+    limbo.push_back(Retired{addr, size, advanceEpoch()});
+    if (limbo.size() >= reclaim_batch)
+        reclaim();
+}
+
+
+template <class Placement>
+void BasicAllocator<Placement>::reclaim() {
+    uint64_t oldest = safeEpoch();
+
+    // A reader that entered at epoch E may still see ranges retired at E.
+    size_t kept = 0;
+    for (size_t i = 0; i < limbo.size(); ++i) {
+        if (limbo[i].epoch < oldest)
+            release(limbo[i].addr, limbo[i].size);
+        else
+            limbo[kept++] = limbo[i];
+    }
+    limbo.resize(kept);
+}
+
+
+template <class Placement>
+double BasicAllocator<Placement>::fragmentation() const {
+    size_t free_total = 0, largest = 0, run = 0;
+
+    for (size_t i = 0; i < ocupation.size(); ++i) {
+        run = ocupation[i] ? 0 : run + 1;
+        if (!ocupation[i]) free_total++;
+        largest = std::max(largest, run);
+    }
+    if (!free_total)
+        return 0;
+    return 1.0 - (double) largest / free_total;
+}
+
+template class BasicAllocator<FirstFit>;
+template class BasicAllocator<NextFit>;
+template class BasicAllocator<BestFit>;
+template class BasicAllocator<AddressOrderedBestFit>;
+
 //int main() {
 //    size_t mem_size = 256;
 //    int *mem = (int *) malloc(mem_size * sizeof(int));
@@ -1,10 +1,24 @@
+#include <atomic>
+#include <cstdint>
+#include <map>
 #include <stdexcept>
 #include <string>
 #include <vector>
+#include "placement.h"
 
 enum class AllocErrorType {
     InvalidFree,
     NoMemory,
+    NoReaderSlot,
+};
+
+// Expected lifetime of a block. Short-lived blocks are placed in the nursery
+// at the front of the arena, long-lived ones in the tenured region growing
+// down from the end, so the two kinds do not interleave.
+enum class AllocHint {
+    Short,      // message buffers etc, default
+    Long,       // session objects, moved only by the tenured pass of defrag
+    Permanent,  // tenured and never moved by defrag
 };
 
 class AllocError : std::runtime_error {
@@ -19,43 +33,228 @@ public:
     AllocErrorType getType() const { return type; }
 };
 
-class Allocator;
+template <class Placement> class BasicAllocator;
+
+// Block address, size and hint shared by every copy of a Pointer, so that
+// moving a block in defrag() updates all of them at once. The address is
+// atomic: epoch readers load it while realloc() moves the block.
+struct PointerCell {
+    std::atomic<void *> p;
+    size_t size;
+    long refs;
+    AllocHint hint;
+    bool atomic_refs;  // false for thread-confined allocators
+    bool sampled;      // recorded by the allocator's AllocSampler
 
+    PointerCell(void *_p, size_t _size, AllocHint _hint, bool _atomic_refs)
+            : p(_p), size(_size), refs(1), hint(_hint), atomic_refs(_atomic_refs), sampled(false) { }
+};
+
+// Refcounted handle to a block. Moves only steal the cell, copies bump one
+// counter, and that counter is a plain increment when the allocator is
+// thread-confined.
 class Pointer {
-    std::shared_ptr<void *> p;
-    std::shared_ptr<size_t> p_size;
+    template <class> friend class BasicAllocator;
+
+    PointerCell *cell;
+
+    void acquire() const {
+        if (!cell) return;
+        if (cell->atomic_refs)
+            __atomic_add_fetch(&cell->refs, 1, __ATOMIC_RELAXED);
+        else
+            ++cell->refs;
+    }
+
+    void release() {
+        if (!cell) return;
+        long left = cell->atomic_refs ? __atomic_sub_fetch(&cell->refs, 1, __ATOMIC_ACQ_REL)
+                                      : --cell->refs;
+        if (!left) delete cell;
+        cell = nullptr;
+    }
+
 public:
-    Pointer();
+    Pointer() : cell(nullptr) { }
+
+    Pointer(void *p, size_t size, AllocHint hint, bool atomic_refs);
+
+    Pointer(const Pointer &o) : cell(o.cell) { acquire(); }
+
+    Pointer(Pointer &&o) noexcept : cell(o.cell) { o.cell = nullptr; }
+
+    Pointer &operator=(const Pointer &o) {
+        o.acquire();
+        release();
+        cell = o.cell;
+        return *this;
+    }
+
+    Pointer &operator=(Pointer &&o) noexcept {
+        if (this != &o) {
+            release();
+            cell = o.cell;
+            o.cell = nullptr;
+        }
+        return *this;
+    }
+
+    ~Pointer() { release(); }
+
+    // Acquire/release: a reader that sees the new address sees the copy too.
+    void *get() const { return cell ? cell->p.load(std::memory_order_acquire) : nullptr; }
+    void set(void *_p) { cell->p.store(_p, std::memory_order_release); }
+
+    size_t getSize() const { return cell ? cell->size : 0; }
+    void setSize(size_t size) { cell->size = size; }
+
+    AllocHint getHint() const { return cell ? cell->hint : AllocHint::Short; }
+
+    bool operator<(const Pointer &o) const { return get() < o.get(); }
+};
+
+class AllocSampler;
+class ThreadPool;
+
 
-    Pointer(void **p, size_t *p_size);
+// Epoch-based reclamation for threads reading arena memory while a writer
+// frees it. Readers wrap every access in enterEpoch()/leaveEpoch(), which
+// never block. While any reader is registered the allocator's free() and
+// realloc() only retire the memory they release; it is reused once every
+// reader that entered before the free has left. Writers are still expected to
+// be serialized, and defrag() must not run while a reader is inside an epoch.
+class EpochDomain {
+    // Epoch a reader entered, 0 while it is outside. One cache line each so
+    // readers never contend with each other.
+    struct alignas(64) ReaderSlot {
+        std::atomic<bool> used;
+        std::atomic<uint64_t> epoch;
+    };
 
-    void *get() const { return *p; }
-    void set(void *_p) {*p = _p;}
+    static const size_t max_readers = 64;
 
-    size_t getSize() const { return *p_size; }
-    void setSize(size_t size) { *p_size = size; }
+    ReaderSlot readers[max_readers];
+    std::atomic<size_t> reader_count;
+    std::atomic<uint64_t> global_epoch;
 
-    bool operator<(const Pointer &o) const {return *p < o.get();}
+protected:
+    EpochDomain();
+
+    bool hasReaders() const { return reader_count.load() > 0; }
+
+    // Epoch to stamp a retired range with; moves the global epoch on.
+    uint64_t advanceEpoch() { return global_epoch.fetch_add(1); }
+
+    // Ranges retired before this epoch are invisible to every reader.
+    uint64_t safeEpoch() const;
+
+public:
+    int registerReader();
+    void unregisterReader(int id);
+
+    void enterEpoch(int id) { readers[id].epoch.store(global_epoch.load()); }
+    void leaveEpoch(int id) { readers[id].epoch.store(0, std::memory_order_release); }
 };
 
-class Allocator {
+
+// Arena allocator handing out movable blocks. Placement decides where new
+// blocks go (see placement.h); Allocator is the first-fit default.
+template <class Placement>
+class BasicAllocator : public EpochDomain {
+    struct BlockMove {
+        Pointer *p;
+        size_t from;
+        size_t to;
+    };
+
+    // Range released by a writer while readers may still look at it.
+    struct Retired {
+        void *addr;
+        size_t size;
+        uint64_t epoch;
+    };
+
+    typedef std::map<void *, Pointer> PointerMap;
+
     void *memory;
     std::vector<bool> ocupation;
-    std::vector<Pointer *> pointers;
+    Placement placement;
+    PointerMap pointers;  // handle table, ordered by block address
+    size_t bytes_moved;
+    size_t large_threshold;
+    bool thread_confined;
+    AllocSampler *sampler;
+
+    std::vector<Retired> limbo;
+    size_t reclaim_batch;
 
-    int find_pointer(Pointer &p);
+    typename PointerMap::iterator find_pointer(Pointer &p) { return pointers.find(p.get()); }
+    size_t offset_of(const Pointer &p) const { return (char *) p.get() - (char *) memory; }
+    bool in_arena(const void *addr) const {
+        return addr >= memory && (char *) addr < (char *) memory + ocupation.size();
+    }
+    bool in_arena(const Pointer &p) const { return in_arena(p.get()); }
+    void mark_used(size_t offset, size_t N);
+    void mark_free(size_t offset, size_t N);
+    void release(void *addr, size_t size);
+    void retire(void *addr, size_t size);
+    Pointer alloc_arena(size_t N, AllocHint hint);
+    Pointer alloc_large(size_t N, AllocHint hint);
+    void realloc_large(Pointer &p, size_t N);
+    void plan_defrag(std::vector<BlockMove> &down, std::vector<BlockMove> &up);
+    void run_moves(const std::vector<BlockMove> &moves, ThreadPool *pool);
 
 public:
-    Allocator(void *base, size_t size);
+    // Blocks of at least large_threshold bytes get their own page-aligned
+    // mapping outside the arena; 0 keeps every block in the arena.
+    BasicAllocator(void *base, size_t size, size_t large_threshold = 0);
 
-    Pointer alloc(size_t N);
+    Pointer alloc(size_t N, AllocHint hint = AllocHint::Short);
 
     void realloc(Pointer &p, size_t N);
 
     void free(Pointer &p);
 
-    void defrag();
+    // Handle of the block starting at addr, for callers that only kept the
+    // raw address. Returns false if no block starts there.
+    bool lookup(void *addr, Pointer &out);
+
+    // Compacts the arena. With threads > 1 the moves run on a thread pool.
+    void defrag(size_t threads = 1);
+
+    // Handles created from now on use plain, non-atomic refcounts. Only for
+    // allocators whose Pointers never leave the owning thread.
+    void setThreadConfined(bool confined) { thread_confined = confined; }
+
+    // Records a sample of the allocations made from now on, see AllocSampler.
+    // The sampler must outlive the blocks it sampled; nullptr turns it off.
+    void setSampler(AllocSampler *s) { sampler = s; }
+
+    // Total bytes copied by defrag() since construction.
+    size_t bytesMoved() const { return bytes_moved; }
+
+    // 1 - (largest free extent / total free bytes), 0 for an unfragmented arena.
+    double fragmentation() const;
+
+    // Releases retired ranges no reader can see any more. free() calls it
+    // every reclaim_batch retirements and alloc() before failing.
+    void reclaim();
+    void setReclaimBatch(size_t n) { reclaim_batch = n; }
+    size_t pendingFrees() const { return limbo.size(); }
 
     std::string dump() { return ""; }
 };
 
+typedef BasicAllocator<FirstFit> Allocator;
+
+
+class EpochGuard {
+    EpochDomain &domain;
+    int id;
+
+public:
+    EpochGuard(EpochDomain &_domain, int _id) : domain(_domain), id(_id) {
+        domain.enterEpoch(id);
+    }
+    ~EpochGuard() { domain.leaveEpoch(id); }
+};
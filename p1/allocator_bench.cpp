@@ -0,0 +1,404 @@
+#include "allocator.h"
+#include "block_move.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+static char arena[128 * 1024];
+
+
+// Chat-like workload: long-lived session objects and a sliding window of
+// short-lived message buffers freed in random order. Defrag runs every
+// `defrag_every` steps and whenever an allocation fails.
+struct LifetimeResult {
+    double fragmentation;
+    size_t bytes_moved;
+    size_t defrags;
+    double seconds;
+};
+
+static LifetimeResult runLifetime(bool hinted, int steps, int defrag_every,
+                                  AllocSampler *sampler = nullptr) {
+    Allocator a(arena, sizeof(arena));
+    a.setSampler(sampler);
+    mt19937 rng(42);
+    auto start = chrono::steady_clock::now();
+
+    vector<Pointer> sessions;
+    deque<Pointer> msgs;
+    AllocHint longHint = hinted ? AllocHint::Long : AllocHint::Short;
+
+    double frag_sum = 0;
+    size_t defrags = 0;
+
+    auto allocRetry = [&](size_t size, AllocHint hint) {
+        try {
+            return a.alloc(size, hint);
+        } catch (AllocError &) {
+            a.defrag();
+            defrags++;
+            return a.alloc(size, hint);
+        }
+    };
+
+    for (int step = 1; step <= steps; ++step) {
+        if (rng() % 400 == 0 && sessions.size() < 60)
+            sessions.push_back(allocRetry(512 + rng() % 1536, longHint));
+        if (rng() % 800 == 0 && !sessions.empty()) {
+            size_t i = rng() % sessions.size();
+            a.free(sessions[i]);
+            sessions.erase(sessions.begin() + i);
+        }
+
+        msgs.push_back(allocRetry(64 + rng() % 448, AllocHint::Short));
+        if (msgs.size() > 96) {
+            size_t i = rng() % msgs.size();
+            a.free(msgs[i]);
+            msgs.erase(msgs.begin() + i);
+        }
+
+        if (step % defrag_every == 0) {
+            frag_sum += a.fragmentation();
+            a.defrag();
+            defrags++;
+        }
+    }
+
+    LifetimeResult r;
+    r.fragmentation = frag_sum / (steps / defrag_every);
+    r.bytes_moved = a.bytesMoved();
+    r.defrags = defrags;
+    r.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for (Pointer &p : sessions)
+        a.free(p);
+    for (Pointer &p : msgs)
+        a.free(p);
+    return r;
+}
+
+
+// Time to compact a large arena where every other block was freed.
+static double runParallelDefrag(size_t threads) {
+    const size_t arena_size = 64 << 20, block = 4 << 20;
+    char *big = (char *) malloc(arena_size);
+    Allocator a(big, arena_size);
+
+    vector<Pointer> ptrs;
+    for (size_t i = 0; i < arena_size / block; ++i) {
+        ptrs.push_back(a.alloc(block));
+        memset(ptrs.back().get(), (int) i, block);
+    }
+    for (size_t i = 0; i < ptrs.size(); i += 2)
+        a.free(ptrs[i]);
+
+    auto start = chrono::steady_clock::now();
+    a.defrag(threads);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    free(big);
+    return elapsed.count();
+}
+
+
+// Cost of copying handles around, as callers storing them in vectors do.
+static double runPointerCopies(bool confined) {
+    Allocator a(arena, sizeof(arena));
+    a.setThreadConfined(confined);
+
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 256; ++i)
+        ptrs.push_back(a.alloc(64));
+
+    auto start = chrono::steady_clock::now();
+    size_t sum = 0;
+    for (int round = 0; round < 20000; ++round) {
+        vector<Pointer> copy(ptrs);
+        sum += copy[round % copy.size()].getSize();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    if (sum == 0)
+        printf("unreachable\n");
+    return elapsed.count();
+}
+
+
+// Copy bandwidth of block_move against memmove, and how long a 1 MB hot
+// working set takes to read right after the copy (cache pollution).
+struct MoveResult {
+    double gbps;
+    double hot_us;
+};
+
+static MoveResult runMove(bool streaming, size_t n, char *src, char *dst, char *hot) {
+    const int rounds = (int) max<size_t>(1, (256u << 20) / n);
+    const size_t hot_size = 1 << 20;
+    double copy = 0, reread = 0;
+    size_t sum = 0;
+
+    for (int r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < hot_size; i += 64)
+            sum += hot[i];
+
+        auto start = chrono::steady_clock::now();
+        if (streaming)
+            block_move(dst, src, n);
+        else
+            memmove(dst, src, n);
+        auto copied = chrono::steady_clock::now();
+        for (size_t i = 0; i < hot_size; i += 64)
+            sum += hot[i];
+        auto done = chrono::steady_clock::now();
+
+        copy += chrono::duration<double>(copied - start).count();
+        reread += chrono::duration<double>(done - copied).count();
+    }
+    if (sum == 1)
+        printf("unreachable\n");
+
+    MoveResult r;
+    r.gbps = (double) n * rounds / copy / 1e9;
+    r.hot_us = reread / rounds * 1e6;
+    return r;
+}
+
+
+// One line of an allocation trace, as written by libarenamalloc.so with
+// ARENA_MALLOC_TRACE set: "a <id> <size>", "r <id> <size>" or "f <id>".
+struct TraceOp {
+    char op;
+    size_t id;
+    size_t size;
+};
+
+static bool loadTrace(const char *path, vector<TraceOp> &ops) {
+    ifstream in(path);
+    if (!in)
+        return false;
+
+    string line;
+    while (getline(in, line)) {
+        TraceOp t = {0, 0, 0};
+        if (line.empty() || line[0] == '#')
+            continue;
+        if (sscanf(line.c_str(), "%c %zu %zu", &t.op, &t.id, &t.size) >= 2)
+            ops.push_back(t);
+    }
+    return true;
+}
+
+
+// Same mix as runLifetime, unhinted, as a trace.
+static vector<TraceOp> syntheticTrace(int steps) {
+    mt19937 rng(42);
+    vector<TraceOp> ops;
+    vector<size_t> sessions, msgs;
+    size_t next_id = 0;
+
+    for (int step = 0; step < steps; ++step) {
+        if (rng() % 400 == 0 && sessions.size() < 60) {
+            sessions.push_back(next_id);
+            ops.push_back(TraceOp{'a', next_id++, 512 + rng() % 1536});
+        }
+        if (rng() % 800 == 0 && !sessions.empty()) {
+            size_t i = rng() % sessions.size();
+            ops.push_back(TraceOp{'f', sessions[i], 0});
+            sessions.erase(sessions.begin() + i);
+        }
+        msgs.push_back(next_id);
+        ops.push_back(TraceOp{'a', next_id++, 64 + rng() % 448});
+        if (msgs.size() > 96) {
+            size_t i = rng() % msgs.size();
+            ops.push_back(TraceOp{'f', msgs[i], 0});
+            msgs.erase(msgs.begin() + i);
+        }
+    }
+    return ops;
+}
+
+
+// Peak of live bytes over the trace, rounded like the malloc front end does.
+static size_t tracePeak(const vector<TraceOp> &ops) {
+    unordered_map<size_t, size_t> sizes;
+    size_t live = 0, peak = 0;
+
+    for (const TraceOp &t : ops) {
+        size_t size = (t.size + 15) / 16 * 16;
+        if (t.op != 'a')
+            live -= sizes[t.id];
+        if (t.op == 'f') {
+            sizes.erase(t.id);
+            continue;
+        }
+        sizes[t.id] = size;
+        live += size;
+        peak = max(peak, live);
+    }
+    return peak;
+}
+
+
+struct ReplayResult {
+    double fragmentation;
+    double mean_ns;
+    double p99_ns;
+    size_t failures;
+};
+
+// Replays a trace without ever calling defrag(), like the malloc front end.
+template <class P>
+static ReplayResult replay(const vector<TraceOp> &ops, char *mem, size_t arena_size) {
+    BasicAllocator<P> a(mem, arena_size, 128 * 1024);
+    unordered_map<size_t, Pointer> live;
+    vector<double> ns;
+    double frag_sum = 0;
+    size_t frag_samples = 0, failures = 0;
+
+    ns.reserve(ops.size());
+    for (size_t i = 0; i < ops.size(); ++i) {
+        const TraceOp &t = ops[i];
+        size_t size = (t.size + 15) / 16 * 16;
+        auto it = live.find(t.id);
+        if (t.op != 'a' && it == live.end())
+            continue;
+
+        // A reused address logged before its free: drop the stale block.
+        if (t.op == 'a' && it != live.end()) {
+            a.free(it->second);
+            live.erase(it);
+        }
+
+        auto start = chrono::steady_clock::now();
+        try {
+            if (t.op == 'a')
+                live[t.id] = a.alloc(size ? size : 16);
+            else if (t.op == 'r')
+                a.realloc(it->second, size ? size : 16);
+            else
+                a.free(it->second);
+        } catch (AllocError &) {
+            failures++;
+        }
+        ns.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+
+        if (t.op == 'f')
+            live.erase(it);
+        if (i % 1000 == 999) {
+            frag_sum += a.fragmentation();
+            frag_samples++;
+        }
+    }
+
+    ReplayResult r;
+    r.fragmentation = frag_samples ? frag_sum / frag_samples : a.fragmentation();
+    r.failures = failures;
+    r.mean_ns = 0;
+    for (double v : ns)
+        r.mean_ns += v;
+    r.mean_ns /= max<size_t>(ns.size(), 1);
+    sort(ns.begin(), ns.end());
+    r.p99_ns = ns.empty() ? 0 : ns[ns.size() * 99 / 100];
+
+    for (auto &kv : live)
+        a.free(kv.second);
+    return r;
+}
+
+
+static void runPlacements(const vector<TraceOp> &ops, const char *name) {
+    // Some slack over the peak so fragmentation, not size, decides failures.
+    size_t arena_size = tracePeak(ops) * 5 / 4 + 4096;
+    char *mem = (char *) malloc(arena_size);
+
+    printf("\ntrace %s: %zu ops, %zu KB arena\n", name, ops.size(), arena_size >> 10);
+    printf("%-22s %14s %10s %10s %9s\n", "policy", "fragmentation", "mean ns", "p99 ns", "failures");
+
+    ReplayResult r[4] = {
+        replay<FirstFit>(ops, mem, arena_size),
+        replay<NextFit>(ops, mem, arena_size),
+        replay<BestFit>(ops, mem, arena_size),
+        replay<AddressOrderedBestFit>(ops, mem, arena_size),
+    };
+    const char *names[4] = {"first-fit", "next-fit", "best-fit", "address-ordered best"};
+    for (int i = 0; i < 4; ++i)
+        printf("%-22s %14.3f %10.0f %10.0f %9zu\n", names[i], r[i].fragmentation,
+               r[i].mean_ns, r[i].p99_ns, r[i].failures);
+
+    free(mem);
+}
+
+
+int main(int argc, char **argv) {
+    const int steps = 30000, defrag_every = 1000;
+
+    if (argc > 1) {
+        vector<TraceOp> ops;
+        if (!loadTrace(argv[1], ops)) {
+            fprintf(stderr, "cannot read trace %s\n", argv[1]);
+            return 1;
+        }
+        runPlacements(ops, argv[1]);
+        return 0;
+    }
+
+    runPlacements(syntheticTrace(steps), "synthetic");
+
+    printf("%-10s %14s %14s %8s\n", "placement", "fragmentation", "bytes moved", "defrags");
+    for (int hinted = 0; hinted < 2; ++hinted) {
+        LifetimeResult r = runLifetime(hinted, steps, defrag_every);
+        printf("%-10s %14.3f %14zu %8zu\n", hinted ? "hinted" : "unhinted",
+               r.fragmentation, r.bytes_moved, r.defrags);
+    }
+
+    {
+        AllocSampler sampler(64 * 1024);
+        double off = runLifetime(true, steps, defrag_every).seconds;
+        double on = runLifetime(true, steps, defrag_every, &sampler).seconds;
+        printf("\nsampling 1/64KB: %zu samples, %.3fs -> %.3fs (%+.1f%%)\n",
+               sampler.samples(), off, on, (on - off) / off * 100);
+    }
+
+    printf("\n%-10s %14s\n", "refcounts", "5.1M copies");
+    printf("%-10s %13.3fs\n", "atomic", runPointerCopies(false));
+    printf("%-10s %13.3fs\n", "confined", runPointerCopies(true));
+
+    {
+        const size_t max_n = 64 << 20;
+        char *src = (char *) malloc(max_n), *dst = (char *) malloc(max_n), *hot = (char *) malloc(1 << 20);
+        memset(src, 1, max_n);
+        memset(dst, 2, max_n);
+        memset(hot, 3, 1 << 20);
+
+        printf("\nblock_move kernel: %s\n", block_move_kernel());
+        printf("%-10s %12s %12s %14s %14s\n", "size", "memmove GB/s", "block GB/s",
+               "memmove hot us", "block hot us");
+        for (size_t n = 64 << 10; n <= max_n; n *= 4) {
+            MoveResult m = runMove(false, n, src, dst, hot);
+            MoveResult b = runMove(true, n, src, dst, hot);
+            printf("%-10zu %12.2f %12.2f %14.1f %14.1f\n", n, m.gbps, b.gbps, m.hot_us, b.hot_us);
+        }
+        free(src);
+        free(dst);
+        free(hot);
+    }
+
+    size_t hw = max(thread::hardware_concurrency(), 2u);
+    printf("\n%-10s %14s\n", "threads", "defrag 64MB");
+    for (size_t threads = 1; threads <= hw; threads *= 2)
+        printf("%-10zu %13.3fs\n", threads, runParallelDefrag(threads));
+    return 0;
+}
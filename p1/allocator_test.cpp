@@ -1,8 +1,13 @@
 #include "allocator.h"
+#include "block_move.h"
+#include "sampler.h"
 
+#include <cstring>
 #include <vector>
 #include <set>
+#include <sstream>
 #include <iostream>
+#include <thread>
 #include "gtest/gtest.h"
 
 using namespace std;
@@ -323,3 +328,386 @@ TEST(Allocator, ReallocGrow) {
     a.free(p);
     a.free(p2);
 }
+
+TEST(Allocator, HintPlacement) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer s = a.alloc(size, AllocHint::Short);
+    Pointer l = a.alloc(size, AllocHint::Long);
+
+    EXPECT_EQ(s.get(), buf);
+    EXPECT_EQ((char *) l.get() + size, buf + sizeof(buf));
+
+    a.free(s);
+    a.free(l);
+}
+
+TEST(Allocator, DefragTenured) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer perm = a.alloc(size, AllocHint::Permanent);
+    Pointer l1 = a.alloc(size, AllocHint::Long);
+    Pointer l2 = a.alloc(size, AllocHint::Long);
+    Pointer s1 = a.alloc(size, AllocHint::Short);
+    Pointer s2 = a.alloc(size, AllocHint::Short);
+
+    writeTo(perm, size);
+    writeTo(l2, size);
+    writeTo(s2, size);
+
+    void *permPtr = perm.get();
+    a.free(l1);
+    a.free(s1);
+    a.defrag();
+
+    EXPECT_EQ(perm.get(), permPtr);
+    EXPECT_EQ((char *) l2.get() + size, permPtr);
+    EXPECT_EQ(s2.get(), buf);
+    EXPECT_EQ(a.bytesMoved(), 2 * size);
+    EXPECT_EQ(a.fragmentation(), 0);
+
+    EXPECT_TRUE(isDataOk(perm, size));
+    EXPECT_TRUE(isDataOk(l2, size));
+    EXPECT_TRUE(isDataOk(s2, size));
+
+    a.free(perm);
+    a.free(l2);
+    a.free(s2);
+}
+
+TEST(Allocator, DefragParallel) {
+    static char big[4 << 20];
+    Allocator a(big, sizeof(big));
+
+    vector<Pointer> ptrs;
+    size_t size = 40000;
+    for (size_t i = 0; i < sizeof(big) / size; ++i) {
+        ptrs.push_back(a.alloc(size));
+        memset(ptrs.back().get(), (int) i, size);
+    }
+
+    vector<int> tags;
+    vector<Pointer> live;
+    for (size_t i = 0; i < ptrs.size(); ++i) {
+        if (i % 3 == 1) {
+            a.free(ptrs[i]);
+        } else {
+            live.push_back(ptrs[i]);
+            tags.push_back((int) i);
+        }
+    }
+
+    a.defrag(4);
+
+    for (size_t i = 0; i < live.size(); ++i) {
+        char *v = reinterpret_cast<char *>(live[i].get());
+        EXPECT_EQ(v, big + i * size);
+        EXPECT_EQ(v[0], (char) tags[i]);
+        EXPECT_EQ(v[size - 1], (char) tags[i]);
+    }
+    EXPECT_EQ(a.fragmentation(), 0);
+
+    for (Pointer &p : live) {
+        a.free(p);
+    }
+}
+
+TEST(Allocator, LargeBlockMapping) {
+    Allocator a(buf, sizeof(buf), 16384);
+
+    size_t size = 20000;
+    Pointer small = a.alloc(135);
+    Pointer large = a.alloc(size);
+
+    EXPECT_TRUE(isValidMemory(small, 135));
+    EXPECT_FALSE(isValidMemory(large, size));
+    writeTo(large, size);
+
+    a.realloc(large, 4 << 20);
+    EXPECT_TRUE(isDataOk(large, size));
+    writeTo(large, 4 << 20);
+
+    a.defrag();
+    EXPECT_TRUE(isDataOk(large, 4 << 20));
+
+    a.realloc(large, size);
+    EXPECT_TRUE(isDataOk(large, size));
+
+    a.free(large);
+    EXPECT_EQ(large.get(), nullptr);
+    a.free(small);
+}
+
+TEST(Allocator, EpochDeferredFree) {
+    Allocator a(buf, sizeof(buf));
+
+    Pointer p = a.alloc(sizeof(buf));
+    int reader = a.registerReader();
+
+    a.enterEpoch(reader);
+    a.free(p);
+    EXPECT_EQ(a.pendingFrees(), 1);
+
+    try {
+        Pointer q = a.alloc(100);
+        a.free(q);
+        EXPECT_TRUE(false);
+    } catch (AllocError &e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::NoMemory);
+    }
+
+    a.leaveEpoch(reader);
+    Pointer q = a.alloc(100);
+    EXPECT_EQ(a.pendingFrees(), 0);
+
+    a.unregisterReader(reader);
+    a.free(q);
+}
+
+TEST(Allocator, EpochConcurrentReaders) {
+    Allocator a(buf, sizeof(buf));
+    a.setReclaimBatch(8);
+
+    int size = 135;
+    atomic<bool> stop(false);
+    atomic<char *> shared(nullptr);
+    atomic<int> corrupt(0);
+
+    vector<thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.push_back(thread([&] {
+            int id = a.registerReader();
+            while (!stop) {
+                EpochGuard guard(a, id);
+                char *v = shared.load();
+                for (int i = 0; v && i < size; i++)
+                    if (v[i] != v[0]) corrupt++;
+            }
+            a.unregisterReader(id);
+        }));
+    }
+
+    // Every block is filled with one value, a reader seeing mixed values
+    // looked at memory that was reused under it.
+    Pointer p = a.alloc(size);
+    memset(p.get(), 1, size);
+    shared = (char *) p.get();
+    for (int i = 0; i < 2000; i++) {
+        Pointer next = a.alloc(size);
+        memset(next.get(), i % 100 + 2, size);
+        shared = (char *) next.get();
+
+        a.free(p);
+        p = next;
+    }
+
+    stop = true;
+    for (auto &t : threads)
+        t.join();
+
+    EXPECT_EQ(corrupt, 0);
+    a.reclaim();
+    EXPECT_EQ(a.pendingFrees(), 0);
+    a.free(p);
+}
+
+TEST(Allocator, EpochReaderThroughHandle) {
+    Allocator a(buf, sizeof(buf), 16384);
+    a.setReclaimBatch(4);
+
+    size_t size = 20000;
+    Pointer p = a.alloc(size);
+    memset(p.get(), 7, size);
+    atomic<bool> stop(false);
+    atomic<int> corrupt(0);
+
+    // Readers go through their own copy of the handle, whose address
+    // realloc() changes under them.
+    vector<thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.push_back(thread([&, p] {
+            int id = a.registerReader();
+            while (!stop) {
+                EpochGuard guard(a, id);
+                char *v = (char *) p.get();
+                for (size_t i = 0; i < size; i += 512)
+                    if (v[i] != 7) corrupt++;
+            }
+            a.unregisterReader(id);
+        }));
+    }
+
+    // Growing copies the block to a new mapping and retires the old one.
+    for (int i = 0; i < 200; i++)
+        a.realloc(p, i % 2 ? size : 4 << 20);
+
+    stop = true;
+    for (auto &t : threads)
+        t.join();
+
+    EXPECT_EQ(corrupt, 0);
+    a.reclaim();
+    EXPECT_EQ(a.pendingFrees(), 0);
+    a.free(p);
+}
+
+TEST(Allocator, PointerCopyAndMove) {
+    Allocator a(buf, sizeof(buf));
+    a.setThreadConfined(true);
+
+    int size = 135;
+    Pointer gap = a.alloc(size);
+    Pointer p = a.alloc(size);
+    writeTo(p, size);
+
+    Pointer copy = p;
+    Pointer moved = std::move(copy);
+    EXPECT_EQ(copy.get(), nullptr);
+    EXPECT_EQ(moved.get(), p.get());
+
+    vector<Pointer> ptrs(8, p);
+    a.free(gap);
+    a.defrag();
+
+    // Every copy shares the handle defrag() updated.
+    EXPECT_EQ(p.get(), buf);
+    EXPECT_EQ(moved.get(), buf);
+    for (Pointer &c : ptrs) {
+        EXPECT_EQ(c.get(), buf);
+    }
+    EXPECT_TRUE(isDataOk(moved, size));
+
+    a.free(p);
+}
+
+static bool blockMoveOk(size_t n, ptrdiff_t shift) {
+    static vector<char> mem(8 << 20);
+    char *src = mem.data() + (2 << 20) + 3;
+    for (size_t i = 0; i < n; i++)
+        src[i] = (char) (i % 251);
+
+    block_move(src + shift, src, n);
+
+    for (size_t i = 0; i < n; i++)
+        if (src[shift + i] != (char) (i % 251))
+            return false;
+    return true;
+}
+
+TEST(BlockMove, Overlapping) {
+    size_t n = 3 * block_move_threshold + 77;
+
+    EXPECT_TRUE(blockMoveOk(n, -1000));
+    EXPECT_TRUE(blockMoveOk(n, 1000));
+    EXPECT_TRUE(blockMoveOk(n, -13));
+    EXPECT_TRUE(blockMoveOk(n, 13));
+    EXPECT_TRUE(blockMoveOk(n, (ptrdiff_t) n + 5));
+    EXPECT_TRUE(blockMoveOk(1000, 7));
+}
+
+TEST(Sampler, RecordsCallSites) {
+    Allocator a(buf, sizeof(buf));
+    AllocSampler sampler(1);  // every allocation
+    a.setSampler(&sampler);
+
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 10; i++) {
+        ptrs.push_back(a.alloc(100));
+    }
+    for (int i = 0; i < 5; i++) {
+        a.free(ptrs[i]);
+    }
+    EXPECT_EQ(sampler.samples(), 10);
+
+    stringstream pprof, folded;
+    sampler.dumpPprof(pprof);
+    sampler.dumpFolded(folded);
+
+    string header;
+    getline(pprof, header);
+    EXPECT_EQ(header.find("heap profile: 5: 500 [10: 1000] @ heap_v2/1"), 0);
+
+    string line;
+    ASSERT_TRUE((bool) getline(folded, line));
+    EXPECT_NE(line.find(' '), string::npos);
+    EXPECT_EQ(line.substr(line.rfind(' ') + 1), "1000");
+
+    a.setSampler(nullptr);
+    for (int i = 5; i < 10; i++) {
+        a.free(ptrs[i]);
+    }
+}
+
+template <class P>
+class Placement : public ::testing::Test {
+};
+
+typedef ::testing::Types<FirstFit, NextFit, BestFit, AddressOrderedBestFit> Placements;
+TYPED_TEST_CASE(Placement, Placements);
+
+TYPED_TEST(Placement, MixedChurn) {
+    BasicAllocator<TypeParam> a(buf, sizeof(buf));
+    srand(7);
+
+    vector<Pointer> ptrs;
+    vector<char> tags;
+    for (int round = 0; round < 2000; round++) {
+        if (!ptrs.empty() && rand() % 3 == 0) {
+            size_t i = rand() % ptrs.size();
+            a.free(ptrs[i]);
+            ptrs.erase(ptrs.begin() + i);
+            tags.erase(tags.begin() + i);
+            continue;
+        }
+        try {
+            size_t size = 1 + rand() % 700;
+            AllocHint hint = rand() % 2 ? AllocHint::Short : AllocHint::Long;
+            ptrs.push_back(a.alloc(size, hint));
+            tags.push_back((char) round);
+            memset(ptrs.back().get(), tags.back(), size);
+        } catch (AllocError &) {
+            a.defrag();
+        }
+    }
+
+    for (size_t i = 0; i < ptrs.size(); i++) {
+        char *v = reinterpret_cast<char *>(ptrs[i].get());
+        EXPECT_TRUE(isValidMemory(ptrs[i], ptrs[i].getSize()));
+        EXPECT_EQ(v[0], tags[i]);
+        EXPECT_EQ(v[ptrs[i].getSize() - 1], tags[i]);
+    }
+    for (Pointer &p : ptrs) {
+        a.free(p);
+    }
+
+    // Everything coalesced back into one extent.
+    Pointer all = a.alloc(sizeof(buf));
+    a.free(all);
+}
+
+// Frees a 100 and a 50 byte hole and returns where a 40 byte block lands.
+template <class P>
+static void *placeInHoles(void *&hole100, void *&hole50) {
+    BasicAllocator<P> a(buf, sizeof(buf));
+
+    Pointer p100 = a.alloc(100);
+    Pointer p10 = a.alloc(10);
+    Pointer p50 = a.alloc(50);
+    Pointer rest = a.alloc(sizeof(buf) - 160);
+
+    hole100 = p100.get();
+    hole50 = p50.get();
+    a.free(p100);
+    a.free(p50);
+    return a.alloc(40).get();
+}
+
+TEST(Placement, BestFitPicksSmallestHole) {
+    void *hole100, *hole50;
+
+    EXPECT_EQ(placeInHoles<FirstFit>(hole100, hole50), hole100);
+    EXPECT_EQ(placeInHoles<BestFit>(hole100, hole50), hole50);
+    EXPECT_EQ(placeInHoles<AddressOrderedBestFit>(hole100, hole50), hole50);
+}
@@ -0,0 +1,150 @@
+#include <cstdint>
+#include <cstring>
+#include "block_move.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+
+typedef void (*StreamFn)(char *dst, const char *src, size_t n, bool backward);
+
+#if defined(HAVE_X86_KERNELS)
+
+static const size_t prefetch_distance = 512;
+
+
+// Forward copies are safe when dst < src: each chunk is loaded completely
+// before it is stored, and stores never reach source bytes not yet loaded.
+// Backward copies mirror that for dst > src.
+static void stream_sse2(char *dst, const char *src, size_t n, bool backward) {
+    if (!backward) {
+        size_t head = (16 - ((uintptr_t) dst & 15)) & 15;
+        std::memmove(dst, src, head);
+        dst += head; src += head; n -= head;
+
+        for (; n >= 64; n -= 64, src += 64, dst += 64) {
+            _mm_prefetch(src + prefetch_distance, _MM_HINT_NTA);
+            __m128i a = _mm_loadu_si128((const __m128i *) src);
+            __m128i b = _mm_loadu_si128((const __m128i *) (src + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *) (src + 32));
+            __m128i d = _mm_loadu_si128((const __m128i *) (src + 48));
+            _mm_stream_si128((__m128i *) dst, a);
+            _mm_stream_si128((__m128i *) (dst + 16), b);
+            _mm_stream_si128((__m128i *) (dst + 32), c);
+            _mm_stream_si128((__m128i *) (dst + 48), d);
+        }
+        _mm_sfence();
+        std::memmove(dst, src, n);
+    } else {
+        size_t tail = (uintptr_t) (dst + n) & 15;
+        std::memmove(dst + n - tail, src + n - tail, tail);
+        n -= tail;
+
+        for (; n >= 64; n -= 64) {
+            const char *s = src + n - 64;
+            char *d = dst + n - 64;
+            _mm_prefetch(s - prefetch_distance, _MM_HINT_NTA);
+            __m128i a = _mm_loadu_si128((const __m128i *) s);
+            __m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *) (s + 32));
+            __m128i e = _mm_loadu_si128((const __m128i *) (s + 48));
+            _mm_stream_si128((__m128i *) d, a);
+            _mm_stream_si128((__m128i *) (d + 16), b);
+            _mm_stream_si128((__m128i *) (d + 32), c);
+            _mm_stream_si128((__m128i *) (d + 48), e);
+        }
+        _mm_sfence();
+        std::memmove(dst, src, n);
+    }
+}
+
+
+__attribute__((target("avx")))
+static void stream_avx(char *dst, const char *src, size_t n, bool backward) {
+    if (!backward) {
+        size_t head = (32 - ((uintptr_t) dst & 31)) & 31;
+        std::memmove(dst, src, head);
+        dst += head; src += head; n -= head;
+
+        for (; n >= 128; n -= 128, src += 128, dst += 128) {
+            _mm_prefetch(src + prefetch_distance, _MM_HINT_NTA);
+            __m256i a = _mm256_loadu_si256((const __m256i *) src);
+            __m256i b = _mm256_loadu_si256((const __m256i *) (src + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i *) (src + 64));
+            __m256i d = _mm256_loadu_si256((const __m256i *) (src + 96));
+            _mm256_stream_si256((__m256i *) dst, a);
+            _mm256_stream_si256((__m256i *) (dst + 32), b);
+            _mm256_stream_si256((__m256i *) (dst + 64), c);
+            _mm256_stream_si256((__m256i *) (dst + 96), d);
+        }
+        _mm_sfence();
+        std::memmove(dst, src, n);
+    } else {
+        size_t tail = (uintptr_t) (dst + n) & 31;
+        std::memmove(dst + n - tail, src + n - tail, tail);
+        n -= tail;
+
+        for (; n >= 128; n -= 128) {
+            const char *s = src + n - 128;
+            char *d = dst + n - 128;
+            _mm_prefetch(s - prefetch_distance, _MM_HINT_NTA);
+            __m256i a = _mm256_loadu_si256((const __m256i *) s);
+            __m256i b = _mm256_loadu_si256((const __m256i *) (s + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i *) (s + 64));
+            __m256i e = _mm256_loadu_si256((const __m256i *) (s + 96));
+            _mm256_stream_si256((__m256i *) d, a);
+            _mm256_stream_si256((__m256i *) (d + 32), b);
+            _mm256_stream_si256((__m256i *) (d + 64), c);
+            _mm256_stream_si256((__m256i *) (d + 96), e);
+        }
+        _mm_sfence();
+        std::memmove(dst, src, n);
+    }
+}
+
+#endif
+
+
+struct Kernel {
+    StreamFn fn;
+    const char *name;
+};
+
+
+static Kernel select_kernel() {
+#if defined(HAVE_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+        return Kernel{stream_avx, "avx-stream"};
+    if (__builtin_cpu_supports("sse2"))
+        return Kernel{stream_sse2, "sse2-stream"};
+#endif
+    return Kernel{nullptr, "memmove"};
+}
+
+
+static const Kernel &kernel() {
+    static const Kernel k = select_kernel();
+    return k;
+}
+
+
+void block_move(void *dst, const void *src, size_t n) {
+    StreamFn fn = kernel().fn;
+
+    if (n < block_move_threshold || !fn || dst == src) {
+        std::memmove(dst, src, n);
+        return;
+    }
+
+    char *d = (char *) dst;
+    const char *s = (const char *) src;
+    fn(d, s, n, d > s && d < s + n);
+}
+
+
+const char *block_move_kernel() {
+    return kernel().name;
+}
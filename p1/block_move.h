@@ -0,0 +1,19 @@
+#ifndef P1_BLOCK_MOVE_H
+#define P1_BLOCK_MOVE_H
+
+#include <cstddef>
+
+// Moves below this size go through memmove: they fit in L2 and are likely to
+// be used right away.
+const size_t block_move_threshold = 1024 * 1024;
+
+// memmove for relocating blocks. Overlap-safe in both directions. Large moves
+// use non-temporal stores with software prefetch, so a compaction pass does
+// not evict the working set from every cache level. The kernel is picked at
+// first use from the CPU features (AVX, SSE2, otherwise plain memmove).
+void block_move(void *dst, const void *src, size_t n);
+
+// Name of the kernel block_move() uses for large moves.
+const char *block_move_kernel();
+
+#endif //P1_BLOCK_MOVE_H
@@ -0,0 +1,389 @@
+// malloc/free/realloc/calloc/posix_memalign on top of Allocator, for running
+// whole programs on the arena:
+//
+//     LD_PRELOAD=./libarenamalloc.so ./chatsrv
+//
+// ARENA_MALLOC_MB sets the arena size (default 64). Blocks of 128 KB and more
+// get their own mapping. defrag() is never called, so addresses stay stable
+// as malloc requires. Counters are printed to stderr at exit.
+// "make bench-preload" runs chatsrv, the proxy and the shell on it and on
+// glibc and compares throughput and peak RSS.
+//
+// ARENA_MALLOC_TRACE=path records every call as a text trace for
+// allocator_bench: "a <ptr> <size>", "r <ptr> <size>" (resized in place) and
+// "f <ptr>", with the address as block id. Each line is one write(); frees
+// are logged before the block is released and allocations once they have
+// an address, but a realloc racing with another thread may still log out of
+// order, which the replay tolerates. Every process truncates the file, so
+// trace one program at a time.
+//
+// Linux/glibc only: the Allocator's own bookkeeping and anything that does
+// not fit in the arena go to glibc through __libc_malloc and friends.
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <new>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "allocator.h"
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+
+namespace {
+
+const size_t min_align = 16;
+const size_t large_threshold = 128 * 1024;
+
+struct Stats {
+    size_t mallocs;
+    size_t frees;
+    size_t reallocs;
+    size_t aligned;
+    size_t fallbacks;
+    size_t live_bytes;
+    size_t peak_bytes;
+};
+
+std::mutex lock;
+alignas(Allocator) char allocator_storage[sizeof(Allocator)];
+Allocator *arena = nullptr;
+size_t arena_size = 0;
+bool init_failed = false;
+
+// Aligned blocks handed out at an offset into their arena block: user -> base.
+std::unordered_map<void *, void *> *aligned_bases = nullptr;
+
+Stats stats;
+
+int trace_fd = -1;
+
+// Set while this thread holds the lock. Allocator's internal new/delete and
+// Pointer's refcount blocks land here again and must go straight to glibc
+// instead of taking the lock twice.
+thread_local bool inside = false;
+
+struct InsideScope {
+    bool was;
+    InsideScope() : was(inside) { inside = true; }
+    ~InsideScope() { inside = was; }
+};
+
+
+size_t roundUp(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+
+// Called with the lock held, from inside an InsideScope.
+bool initArena() {
+    if (arena)
+        return true;
+    if (init_failed)
+        return false;
+
+    size_t mb = 64;
+    const char *env = getenv("ARENA_MALLOC_MB");
+    if (env && atoi(env) > 0)
+        mb = (size_t) atoi(env);
+    arena_size = mb << 20;
+
+    void *mem = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        init_failed = true;
+        return false;
+    }
+
+    const char *trace_path = getenv("ARENA_MALLOC_TRACE");
+    if (trace_path) {
+        trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (trace_fd >= 0)
+            write(trace_fd, "# arenamalloc trace v1\n", 23);
+    }
+
+    arena = new(allocator_storage) Allocator(mem, arena_size, large_threshold);
+    arena->setThreadConfined(true);  // handles never leave the lock
+    aligned_bases = new std::unordered_map<void *, void *>();
+    return true;
+}
+
+
+void trace(char op, void *ptr, size_t size) {
+    if (trace_fd < 0 || !ptr)
+        return;
+
+    char line[64];
+    int n = op == 'f' ? snprintf(line, sizeof(line), "f %zu\n", (size_t) ptr)
+                      : snprintf(line, sizeof(line), "%c %zu %zu\n", op, (size_t) ptr, size);
+    if (n > 0)
+        write(trace_fd, line, (size_t) n);
+}
+
+
+void account(size_t allocated, size_t freed) {
+    stats.live_bytes += allocated;
+    stats.live_bytes -= freed;
+    if (stats.live_bytes > stats.peak_bytes)
+        stats.peak_bytes = stats.live_bytes;
+}
+
+
+// Called with the lock held. Returns nullptr if the arena is full.
+void *arenaAlloc(size_t size) {
+    if (!initArena())
+        return nullptr;
+
+    try {
+        Pointer p = arena->alloc(roundUp(size ? size : 1, min_align));
+        account(p.getSize(), 0);
+        return p.get();
+    } catch (AllocError &) {
+        return nullptr;
+    }
+}
+
+
+// Called with the lock held. Finds the arena block behind a user pointer.
+bool arenaLookup(void *ptr, Pointer &p, void *&base) {
+    if (!arena)
+        return false;
+
+    base = ptr;
+    auto it = aligned_bases->find(ptr);
+    if (it != aligned_bases->end())
+        base = it->second;
+    return arena->lookup(base, p);
+}
+
+
+void *allocate(size_t size) {
+    if (inside)
+        return __libc_malloc(size);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        InsideScope scope;
+        stats.mallocs++;
+        void *ptr = arenaAlloc(size);
+        if (ptr) {
+            trace('a', ptr, size);
+            return ptr;
+        }
+        stats.fallbacks++;
+    }
+    void *ptr = __libc_malloc(size);
+    trace('a', ptr, size);
+    return ptr;
+}
+
+
+void release(void *ptr) {
+    if (!ptr)
+        return;
+    if (inside) {
+        __libc_free(ptr);
+        return;
+    }
+
+    trace('f', ptr, 0);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        InsideScope scope;
+        Pointer p;
+        void *base;
+        if (arenaLookup(ptr, p, base)) {
+            stats.frees++;
+            account(0, p.getSize());
+            if (base != ptr)
+                aligned_bases->erase(ptr);
+            arena->free(p);
+            return;
+        }
+    }
+    __libc_free(ptr);
+}
+
+
+int allocateAligned(void **out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+    if (alignment <= min_align) {
+        *out = allocate(size);
+        return *out ? 0 : ENOMEM;
+    }
+    if (inside) {
+        *out = __libc_memalign(alignment, size);
+        return *out ? 0 : ENOMEM;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        InsideScope scope;
+        stats.aligned++;
+        void *base = arenaAlloc(size + alignment);
+        if (base) {
+            void *ptr = (void *) roundUp((size_t) base, alignment);
+            if (ptr != base)
+                (*aligned_bases)[ptr] = base;
+            *out = ptr;
+            trace('a', ptr, size);
+            return 0;
+        }
+        stats.fallbacks++;
+    }
+    *out = __libc_memalign(alignment, size);
+    trace('a', *out, size);
+    return *out ? 0 : ENOMEM;
+}
+
+
+size_t usableSize(void *ptr) {
+    typedef size_t (*UsableSizeFn)(void *);
+    static UsableSizeFn libc_usable_size = (UsableSizeFn) dlsym(RTLD_NEXT, "malloc_usable_size");
+
+    // Blocks allocated with the lock held came from glibc, and taking it
+    // again here would deadlock.
+    if (!inside) {
+        std::lock_guard<std::mutex> guard(lock);
+        InsideScope scope;
+        Pointer p;
+        void *base;
+        if (arenaLookup(ptr, p, base))
+            return p.getSize() - ((char *) ptr - (char *) base);
+    }
+    return libc_usable_size ? libc_usable_size(ptr) : 0;
+}
+
+
+void *reallocate(void *ptr, size_t size) {
+    if (!ptr)
+        return allocate(size);
+    if (!size) {
+        release(ptr);
+        return nullptr;
+    }
+    if (inside)
+        return __libc_realloc(ptr, size);
+
+    size_t old_size = 0;
+    bool ours = false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        InsideScope scope;
+        Pointer p;
+        void *base;
+        if (arenaLookup(ptr, p, base)) {
+            ours = true;
+            stats.reallocs++;
+            old_size = p.getSize() - ((char *) ptr - (char *) base);
+
+            if (base == ptr) {
+                size_t before = p.getSize();
+                try {
+                    arena->realloc(p, roundUp(size, min_align));
+                    account(p.getSize(), before);
+                    if (p.get() == ptr) {
+                        trace('r', ptr, size);
+                    } else {
+                        trace('f', ptr, 0);
+                        trace('a', p.get(), size);
+                    }
+                    return p.get();
+                } catch (AllocError &) {
+                }
+            }
+        }
+    }
+    if (!ours) {
+        void *moved = __libc_realloc(ptr, size);
+        if (moved == ptr) {
+            trace('r', ptr, size);
+        } else if (moved) {
+            trace('f', ptr, 0);
+            trace('a', moved, size);
+        }
+        return moved;
+    }
+
+    // Aligned block, or no room left in the arena: move it by hand.
+    void *moved = allocate(size);
+    if (!moved)
+        return nullptr;
+    memcpy(moved, ptr, old_size < size ? old_size : size);
+    release(ptr);
+    return moved;
+}
+
+
+__attribute__((destructor))
+void printStats() {
+    char line[512];
+    int n = snprintf(line, sizeof(line),
+                     "arenamalloc: arena %zu MB, malloc %zu, free %zu, realloc %zu, "
+                     "aligned %zu, glibc fallback %zu, live %zu B, peak %zu B\n",
+                     arena_size >> 20, stats.mallocs, stats.frees, stats.reallocs,
+                     stats.aligned, stats.fallbacks, stats.live_bytes, stats.peak_bytes);
+    if (n > 0)
+        write(STDERR_FILENO, line, (size_t) n);
+}
+
+}
+
+
+extern "C" {
+
+void *malloc(size_t size) {
+    return allocate(size);
+}
+
+void free(void *ptr) {
+    release(ptr);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (size && n > (size_t) -1 / size)
+        return nullptr;
+    if (inside)
+        return __libc_calloc(n, size);
+
+    void *ptr = allocate(n * size);
+    if (ptr)
+        memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    return reallocate(ptr, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    return allocateAligned(out, alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *ptr = nullptr;
+    return allocateAligned(&ptr, alignment, size) ? nullptr : ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return ptr ? usableSize(ptr) : 0;
+}
+
+}
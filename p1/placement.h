@@ -0,0 +1,175 @@
+#ifndef P1_PLACEMENT_H
+#define P1_PLACEMENT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+// Placement policies for BasicAllocator. A policy picks the offset for a new
+// block of N bytes. The occupancy map is always up to date when find() runs.
+// use() and release() report every range the allocator marks busy or free,
+// and reset() rebuilds the policy state after defrag(). Short-lived blocks
+// prefer low addresses and tenured ones high addresses, as far as the policy
+// allows.
+
+
+// Scans from the front of the arena for short-lived blocks and from the end
+// for tenured ones. No state of its own.
+class FirstFit {
+protected:
+    static bool scanUp(const std::vector<bool> &map, size_t from, size_t N, size_t &offset) {
+        size_t run = 0;
+        for (size_t i = from; i < map.size(); ++i) {
+            run = map[i] ? 0 : run + 1;
+            if (run == N) {
+                offset = i + 1 - N;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool scanDown(const std::vector<bool> &map, size_t from, size_t N, size_t &offset) {
+        size_t run = 0;
+        for (size_t i = from; i > 0; --i) {
+            run = map[i - 1] ? 0 : run + 1;
+            if (run == N) {
+                offset = i - 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    bool find(const std::vector<bool> &map, size_t N, bool tenured, size_t &offset) {
+        return tenured ? scanDown(map, map.size(), N, offset) : scanUp(map, 0, N, offset);
+    }
+
+    void use(size_t, size_t) { }
+    void release(size_t, size_t) { }
+    void reset(const std::vector<bool> &) { }
+};
+
+
+// First fit resuming where the previous search stopped, wrapping around once.
+// One roving cursor per direction.
+class NextFit : public FirstFit {
+    size_t up_cursor;
+    size_t down_cursor;
+
+public:
+    NextFit() : up_cursor(0), down_cursor(SIZE_MAX) { }
+
+    bool find(const std::vector<bool> &map, size_t N, bool tenured, size_t &offset) {
+        if (tenured) {
+            size_t from = std::min(down_cursor, map.size());
+            if (!scanDown(map, from, N, offset) && !scanDown(map, map.size(), N, offset))
+                return false;
+            down_cursor = offset;
+        } else {
+            size_t from = std::min(up_cursor, map.size());
+            if (!scanUp(map, from, N, offset) && !scanUp(map, 0, N, offset))
+                return false;
+            up_cursor = offset + N;
+        }
+        return true;
+    }
+
+    void reset(const std::vector<bool> &) {
+        up_cursor = 0;
+        down_cursor = SIZE_MAX;
+    }
+};
+
+
+// Best fit over an index of free extents: the smallest extent that holds the
+// block. Ties go to the lowest address when AddressOrdered, otherwise to the
+// most recently freed extent. Adjacent free extents are coalesced.
+template <bool AddressOrdered>
+class BestFitIndex {
+    typedef std::pair<size_t, uint64_t> Key;  // length, tie-break
+
+    struct Extent {
+        size_t length;
+        uint64_t tie;
+    };
+
+    std::set<std::pair<Key, size_t>> by_size;  // -> offset
+    std::map<size_t, Extent> by_offset;
+    uint64_t seq;
+
+    void insert(size_t offset, size_t length) {
+        if (!length)
+            return;
+        uint64_t tie = AddressOrdered ? offset : UINT64_MAX - seq++;
+        by_offset[offset] = Extent{length, tie};
+        by_size.insert(std::make_pair(Key(length, tie), offset));
+    }
+
+    void erase(typename std::map<size_t, Extent>::iterator it) {
+        by_size.erase(std::make_pair(Key(it->second.length, it->second.tie), it->first));
+        by_offset.erase(it);
+    }
+
+public:
+    BestFitIndex() : seq(0) { }
+
+    bool find(const std::vector<bool> &, size_t N, bool tenured, size_t &offset) {
+        auto it = by_size.lower_bound(std::make_pair(Key(N, 0), (size_t) 0));
+        if (it == by_size.end())
+            return false;
+        offset = tenured ? it->second + it->first.first - N : it->second;
+        return true;
+    }
+
+    // [offset, offset + N) lies inside one free extent: split it.
+    void use(size_t offset, size_t N) {
+        auto it = by_offset.upper_bound(offset);
+        --it;
+        size_t start = it->first, end = it->first + it->second.length;
+        erase(it);
+        insert(start, offset - start);
+        insert(offset + N, end - offset - N);
+    }
+
+    void release(size_t offset, size_t N) {
+        auto next = by_offset.lower_bound(offset);
+        if (next != by_offset.end() && next->first == offset + N) {
+            N += next->second.length;
+            erase(next);
+        }
+        auto prev = by_offset.lower_bound(offset);
+        if (prev != by_offset.begin()) {
+            --prev;
+            if (prev->first + prev->second.length == offset) {
+                offset = prev->first;
+                N += prev->second.length;
+                erase(prev);
+            }
+        }
+        insert(offset, N);
+    }
+
+    void reset(const std::vector<bool> &map) {
+        by_size.clear();
+        by_offset.clear();
+
+        size_t start = 0;
+        for (size_t i = 0; i <= map.size(); ++i) {
+            if (i < map.size() && !map[i])
+                continue;
+            insert(start, i - start);
+            start = i + 1;
+        }
+    }
+};
+
+typedef BestFitIndex<false> BestFit;
+typedef BestFitIndex<true> AddressOrderedBestFit;
+
+#endif //P1_PLACEMENT_H
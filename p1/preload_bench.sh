@@ -0,0 +1,82 @@
+#!/bin/bash
+# chatsrv (p2), the proxy (p3) and the shell (p5) on glibc malloc and then
+# on libarenamalloc.so, with throughput and peak RSS side by side:
+#
+#     make bench-preload
+#
+# DURATION (seconds of load per server, default 5), CLIENTS (default 200),
+# RATE (messages per second offered, default 2000) and ROUNDS (times the
+# shell replays its test scripts, default 100) size the run. ARENA_MALLOC_MB
+# reaches the preloaded programs. The shell's children inherit LD_PRELOAD,
+# so what they allocate is measured too. chatsrv listens on 3100, the proxy
+# on 3200.
+
+cd "$(dirname "$0")"
+DURATION=${DURATION:-5}
+CLIENTS=${CLIENTS:-200}
+RATE=${RATE:-2000}
+ROUNDS=${ROUNDS:-100}
+PRELOAD=$PWD/libarenamalloc.so
+
+make -s libarenamalloc.so || exit 1
+make -s -C ../p2 chatsrv loadgen || exit 1
+make -s -C ../p3 proxysrv INC= LIB= || exit 1
+make -s -C ../p5 shell || exit 1
+
+work=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$work"' EXIT
+printf '3200,127.0.0.1:3100,' > "$work/proxy.cfg"
+for i in $(seq $ROUNDS); do cat ../p5/tests/[1-4].sh; done > "$work/script"
+
+# VmHWM of a live process in kB; nothing once it has exited.
+peak() {
+    awk '/^VmHWM/ { print $2 }' /proc/$1/status 2>/dev/null
+}
+
+# Delivered messages per second through port $1.
+load() {
+    ../p2/loadgen --port $1 --clients $CLIENTS --senders $CLIENTS --rate $RATE --duration $DURATION 2>/dev/null |
+        awk -F': ' '/"delivered_per_sec"/ { sub(",", "", $2); print $2 }'
+}
+
+report() {
+    printf '%-8s %-6s %14s %10s kB\n' "$1" "$2" "$3" "$4"
+}
+
+# $1 is the name of the allocator, $2 the LD_PRELOAD for it, empty for glibc.
+run() {
+    local env=${2:+LD_PRELOAD=$2}
+
+    env $env ../p2/chatsrv > /dev/null 2>&1 &
+    local srv=$!
+    sleep 0.5
+    local rate=$(load 3100)
+    report chatsrv $1 "$rate msg/s" $(peak $srv)
+
+    # The proxy in front of a chatsrv on glibc: only the proxy changes.
+    kill $srv; wait $srv 2>/dev/null
+    ../p2/chatsrv > /dev/null 2>&1 &
+    srv=$!
+    env $env ../p3/proxysrv "$work/proxy.cfg" > /dev/null 2>&1 &
+    local proxy=$!
+    sleep 0.5
+    rate=$(load 3200)
+    report proxy $1 "$rate msg/s" $(peak $proxy)
+    kill $proxy $srv; wait $proxy $srv 2>/dev/null
+
+    local start=$(date +%s%N) kb=0 k
+    (cd "$work" && exec env $env "$OLDPWD/../p5/shell" < script > /dev/null 2>&1) &
+    local shell=$!
+    while kill -0 $shell 2>/dev/null; do
+        k=$(peak $shell)
+        [ -n "$k" ] && kb=$k
+        sleep 0.05
+    done
+    wait $shell
+    local ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    report shell $1 "$(( ROUNDS * 4000 / (ms ? ms : 1) )) scripts/s" $kb
+}
+
+printf '%-8s %-6s %14s %13s\n' program malloc throughput "peak RSS"
+run glibc ""
+run arena "$PRELOAD"
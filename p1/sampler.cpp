@@ -0,0 +1,141 @@
+#include <cmath>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <fstream>
+#include <string>
+#include "sampler.h"
+
+
+AllocSampler::AllocSampler(size_t _sample_bytes) :
+        sample_bytes(_sample_bytes ? _sample_bytes : 1),
+        total_samples(0),
+        rng(std::random_device()()) {
+    bytes_until_sample = nextInterval();
+}
+
+
+// Exponentially distributed gaps make every allocated byte equally likely to
+// trigger a sample, whatever the allocation sizes are.
+size_t AllocSampler::nextInterval() {
+    std::exponential_distribution<double> gap(1.0 / sample_bytes);
+    return (size_t) gap(rng) + 1;
+}
+
+
+// Estimated number of allocations a site made, given what was sampled there:
+// an allocation of `avg` bytes is sampled with probability 1 - e^(-avg/rate).
+double AllocSampler::scale(size_t bytes, size_t count) const {
+    if (!count)
+        return 0;
+    double avg = (double) bytes / count;
+    return 1.0 / (1.0 - std::exp(-avg / sample_bytes));
+}
+
+
+void AllocSampler::recordAlloc(const void *id, size_t size) {
+    void *frames[max_depth + skip_frames];
+    int depth = backtrace(frames, max_depth + skip_frames);
+
+    Stack stack;
+    for (int i = skip_frames; i < depth; ++i)
+        stack.push_back(frames[i]);
+
+    auto it = sites.insert(std::make_pair(stack, Site{0, 0, 0, 0, 0, 0})).first;
+    Site &site = it->second;
+    site.allocs++;
+    site.alloc_bytes += size;
+    site.live++;
+    site.live_bytes += size;
+    total_samples++;
+
+    live[id] = Sample{&it->first, size, Clock::now()};
+}
+
+
+void AllocSampler::recordFree(const void *id) {
+    auto it = live.find(id);
+    if (it == live.end())
+        return;
+
+    Site &site = sites[*it->second.stack];
+    site.live--;
+    site.live_bytes -= it->second.size;
+    site.freed++;
+    site.lifetime_us += std::chrono::duration<double, std::micro>(Clock::now() - it->second.born).count();
+
+    live.erase(it);
+}
+
+
+void AllocSampler::dumpPprof(std::ostream &out) const {
+    double in_objs = 0, in_bytes = 0, all_objs = 0, all_bytes = 0;
+
+    for (auto &kv : sites) {
+        double f = scale(kv.second.alloc_bytes, kv.second.allocs);
+        in_objs += kv.second.live * f;
+        in_bytes += kv.second.live_bytes * f;
+        all_objs += kv.second.allocs * f;
+        all_bytes += kv.second.alloc_bytes * f;
+    }
+
+    out << "heap profile: " << (size_t) in_objs << ": " << (size_t) in_bytes
+        << " [" << (size_t) all_objs << ": " << (size_t) all_bytes << "] @ heap_v2/"
+        << sample_bytes << "\n";
+
+    for (auto &kv : sites) {
+        const Site &s = kv.second;
+        out << s.live << ": " << s.live_bytes << " [" << s.allocs << ": " << s.alloc_bytes << "] @";
+        for (void *pc : kv.first)
+            out << " " << pc;
+        out << "\n";
+    }
+
+    // pprof needs the mappings to symbolize the addresses.
+    out << "\nMAPPED_LIBRARIES:\n";
+    std::ifstream maps("/proc/self/maps");
+    out << maps.rdbuf();
+}
+
+
+// "binary(_ZN3fooEv+0x1a) [0x4005d4]" -> "foo()", or the address if there is
+// no symbol to show.
+static std::string frameName(void *pc, const char *symbol) {
+    std::string s(symbol ? symbol : "");
+    size_t open = s.find('('), plus = s.find('+', open);
+
+    if (open != std::string::npos && plus != std::string::npos && plus > open + 1) {
+        std::string mangled = s.substr(open + 1, plus - open - 1);
+        int status;
+        char *demangled = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr, &status);
+        std::string name = status == 0 ? demangled : mangled;
+        std::free(demangled);
+        return name;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%p", pc);
+    return buf;
+}
+
+
+void AllocSampler::dumpFolded(std::ostream &out, FoldedValue value) const {
+    for (auto &kv : sites) {
+        const Stack &stack = kv.first;
+        const Site &s = kv.second;
+        if (stack.empty())
+            continue;
+
+        char **symbols = backtrace_symbols(stack.data(), (int) stack.size());
+        for (size_t i = stack.size(); i > 0; --i) {
+            out << frameName(stack[i - 1], symbols ? symbols[i - 1] : nullptr);
+            out << (i > 1 ? ";" : " ");
+        }
+        std::free(symbols);
+
+        if (value == FoldedValue::Bytes)
+            out << (size_t) (s.alloc_bytes * scale(s.alloc_bytes, s.allocs)) << "\n";
+        else
+            out << (size_t) s.lifetime_us << "\n";
+    }
+}
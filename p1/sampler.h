@@ -0,0 +1,85 @@
+#ifndef P1_SAMPLER_H
+#define P1_SAMPLER_H
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+
+// Heap sampler for Allocator. On average one allocation per sample_bytes
+// allocated bytes is recorded, so large blocks are sampled more often than
+// small ones. Each sample keeps the call stack, size and lifetime, and is
+// aggregated per call site. Allocations that are not sampled only cost a
+// subtraction.
+class AllocSampler {
+public:
+    enum class FoldedValue {
+        Bytes,       // estimated bytes allocated at the site
+        LifetimeUs,  // total lifetime of the freed samples, in microseconds
+    };
+
+    explicit AllocSampler(size_t sample_bytes = 512 * 1024);
+
+    // Called by Allocator for every allocation, true if this one is sampled.
+    bool shouldSample(size_t size) {
+        if (size < bytes_until_sample) {
+            bytes_until_sample -= size;
+            return false;
+        }
+        bytes_until_sample = nextInterval();
+        return true;
+    }
+
+    // id identifies the block until recordFree, size is the requested size.
+    void recordAlloc(const void *id, size_t size);
+    void recordFree(const void *id);
+
+    // gperftools heap profile ("heap_v2"), readable by pprof. Counts are
+    // scaled up to estimate every allocation, not only the sampled ones.
+    void dumpPprof(std::ostream &out) const;
+
+    // One "frame;frame;frame value" line per call site, root frame first,
+    // for flamegraph.pl and similar tools.
+    void dumpFolded(std::ostream &out, FoldedValue value = FoldedValue::Bytes) const;
+
+    size_t samples() const { return total_samples; }
+
+private:
+    typedef std::vector<void *> Stack;
+    typedef std::chrono::steady_clock Clock;
+
+    struct Sample {
+        const Stack *stack;
+        size_t size;
+        Clock::time_point born;
+    };
+
+    struct Site {
+        size_t allocs;
+        size_t alloc_bytes;
+        size_t live;
+        size_t live_bytes;
+        size_t freed;
+        double lifetime_us;
+    };
+
+    static const int max_depth = 32;
+    static const int skip_frames = 2;  // recordAlloc and Allocator::alloc
+
+    size_t sample_bytes;
+    size_t bytes_until_sample;
+    size_t total_samples;
+    std::mt19937_64 rng;
+
+    std::map<Stack, Site> sites;
+    std::unordered_map<const void *, Sample> live;
+
+    size_t nextInterval();
+    double scale(size_t bytes, size_t count) const;
+};
+
+#endif //P1_SAMPLER_H
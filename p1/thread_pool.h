@@ -0,0 +1,86 @@
+#ifndef P1_THREAD_POOL_H
+#define P1_THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Fixed set of worker threads running batches of jobs. run() hands out the
+// jobs of one batch, helps executing them and returns when all of them have
+// finished, so consecutive batches never overlap.
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+
+    const std::vector<std::function<void()>> *jobs;
+    size_t next_job;
+    size_t unfinished;
+    bool stopping;
+
+    bool runOne(std::unique_lock<std::mutex> &lock) {
+        if (!jobs || next_job == jobs->size())
+            return false;
+
+        const std::function<void()> &job = (*jobs)[next_job++];
+        lock.unlock();
+        job();
+        lock.lock();
+
+        if (--unfinished == 0)
+            done_cv.notify_all();
+        return true;
+    }
+
+    void workerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_cv.wait(lock, [this] { return stopping || (jobs && next_job < jobs->size()); });
+            if (stopping)
+                return;
+            runOne(lock);
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads) : jobs(nullptr), next_job(0), unfinished(0), stopping(false) {
+        for (size_t i = 1; i < threads; ++i)
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (auto &t : workers)
+            t.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return workers.size() + 1; }
+
+    void run(const std::vector<std::function<void()>> &batch) {
+        if (batch.empty())
+            return;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs = &batch;
+        next_job = 0;
+        unfinished = batch.size();
+        work_cv.notify_all();
+
+        while (runOne(lock));
+        done_cv.wait(lock, [this] { return unfinished == 0; });
+        jobs = nullptr;
+    }
+};
+
+#endif //P1_THREAD_POOL_H
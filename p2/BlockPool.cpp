@@ -0,0 +1,47 @@
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "BlockPool.h"
+
+#define POOL_KEEP 256  // free blocks kept per thread
+
+namespace {
+
+// Blocks are taken and given back by the same loop thread, so each thread
+// keeps its own list and nothing is locked.
+struct FreeList {
+    std::vector<void *> blocks;
+
+    ~FreeList() {
+        for (void *block : blocks)
+            std::free(block);
+    }
+};
+
+thread_local FreeList free_list;
+
+}
+
+
+void *BlockPool::get() {
+    if (!free_list.blocks.empty()) {
+        void *block = free_list.blocks.back();
+        free_list.blocks.pop_back();
+        return block;
+    }
+
+    void *block = std::malloc(POOL_BLOCK);
+    if (!block)
+        throw std::bad_alloc();
+    return block;
+}
+
+
+void BlockPool::put(void *block) {
+    if (!block)
+        return;
+    if (free_list.blocks.size() < POOL_KEEP)
+        free_list.blocks.push_back(block);
+    else
+        std::free(block);
+}
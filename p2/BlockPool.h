@@ -0,0 +1,24 @@
+#ifndef P2_BLOCKPOOL_H
+#define P2_BLOCKPOOL_H
+
+#include <cstddef>
+
+#define POOL_BLOCK 4096  // bytes per block
+
+
+// Fixed-size blocks for per-connection buffers, which connections take
+// while they have data and give back as soon as it is drained, so an idle
+// connection holds none. Freed blocks wait on a free list of the thread
+// for the next taker; beyond a limit they go back to malloc.
+class BlockPool {
+public:
+    static void *get();
+    static void put(void *block);
+
+    // For std::unique_ptr.
+    struct Deleter {
+        void operator()(char *block) const { put(block); }
+    };
+};
+
+#endif //P2_BLOCKPOOL_H
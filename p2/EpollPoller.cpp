@@ -0,0 +1,100 @@
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+#include "Poller.h"
+
+// Linux
+
+
+class EpollPoller : public Poller {
+    int epoll_fd;
+    std::vector<struct epoll_event> ready;  // reused by every wait()
+
+    static unsigned toEpoll(unsigned flags) {
+        unsigned events = EPOLLRDHUP;
+        if (flags & PollIn)
+            events |= EPOLLIN;
+        if (flags & PollOut)
+            events |= EPOLLOUT;
+        if (flags & PollEdge)
+            events |= EPOLLET;
+        return events;
+    }
+
+    void control(int op, int fd, unsigned events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, op, fd, &ev) == -1)
+            throw std::system_error(errno, std::system_category());
+    }
+
+public:
+    EpollPoller() {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1)
+            throw std::system_error(errno, std::system_category());
+    }
+
+    ~EpollPoller() {
+        close(epoll_fd);
+    }
+
+    void addListener(int fd) {
+        // Level-triggered: accept() is retried on the next wait if a batch
+        // is cut short. EPOLLEXCLUSIVE wakes one epoll instance, not all.
+        control(EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLEXCLUSIVE);
+    }
+
+    void add(int fd, unsigned flags) {
+        control(EPOLL_CTL_ADD, fd, toEpoll(flags));
+    }
+
+    void modify(int fd, unsigned flags) {
+        control(EPOLL_CTL_MOD, fd, toEpoll(flags));
+    }
+
+    void remove(int fd) {
+        struct epoll_event ev;  // ignored, but pre-2.6.9 kernels want one
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+    }
+
+    int wait(PollEvent *events, int max, int timeout_ms) {
+        if ((int) ready.size() < max)
+            ready.resize(max);
+
+        int n = epoll_wait(epoll_fd, ready.data(), max, timeout_ms);
+        if (n == -1) {
+            if (errno == EINTR)
+                return 0;
+            throw std::system_error(errno, std::system_category());
+        }
+
+        for (int i = 0; i < n; ++i) {
+            unsigned e = ready[i].events;
+            events[i].fd = ready[i].data.fd;
+            events[i].flags = 0;
+            // Errors and hang-ups surface as a read returning 0 or -1, and
+            // come through even when reading is off.
+            if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                events[i].flags |= PollIn;
+            if (e & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                events[i].flags |= PollHup;
+            if (e & EPOLLOUT)
+                events[i].flags |= PollOut;
+        }
+        return n;
+    }
+
+    const char *name() const { return "epoll"; }
+};
+
+
+Poller *Poller::create() {
+    return new EpollPoller();
+}
+
+#endif
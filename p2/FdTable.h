@@ -0,0 +1,89 @@
+#ifndef P2_FDTABLE_H
+#define P2_FDTABLE_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+
+// Per-descriptor state indexed by the descriptor itself. The kernel hands
+// out the lowest free number, so the table stays dense. Entries live in
+// chunks of 1024 that never move once allocated, so pointers into the
+// table (timers, room member arrays) stay valid for as long as the entry
+// exists. Chunk memory is only touched as its entries are used.
+template <class T>
+class FdTable {
+    static const int chunk_bits = 10;
+    static const size_t chunk_size = (size_t) 1 << chunk_bits;
+
+    struct Chunk {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type items[chunk_size];
+        bool used[chunk_size];
+
+        Chunk() : used() { }
+        T *at(size_t i) { return reinterpret_cast<T *>(&items[i]); }
+    };
+
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    size_t count;
+
+public:
+    FdTable() : count(0) { }
+
+    ~FdTable() {
+        forEach([](int, T &item) { item.~T(); });
+    }
+
+    FdTable(const FdTable &) = delete;
+    FdTable &operator=(const FdTable &) = delete;
+
+    // The entry of fd, or nullptr if it has none.
+    T *find(int fd) {
+        size_t c = (size_t) fd >> chunk_bits, i = (size_t) fd & (chunk_size - 1);
+        if (fd < 0 || c >= chunks.size() || !chunks[c] || !chunks[c]->used[i])
+            return nullptr;
+        return chunks[c]->at(i);
+    }
+
+    // A new entry for fd, which must not have one.
+    T &insert(int fd) {
+        size_t c = (size_t) fd >> chunk_bits, i = (size_t) fd & (chunk_size - 1);
+        if (c >= chunks.size())
+            chunks.resize(c + 1);
+        if (!chunks[c])
+            chunks[c].reset(new Chunk());
+
+        T *item = new (chunks[c]->at(i)) T();
+        chunks[c]->used[i] = true;
+        count++;
+        return *item;
+    }
+
+    void erase(int fd) {
+        T *item = find(fd);
+        if (!item)
+            return;
+        item->~T();
+        chunks[(size_t) fd >> chunk_bits]->used[(size_t) fd & (chunk_size - 1)] = false;
+        count--;
+    }
+
+    size_t size() const { return count; }
+
+    // Calls f(fd, entry) for every entry, in descriptor order. f must not
+    // insert or erase.
+    template <class F>
+    void forEach(F f) {
+        for (size_t c = 0; c < chunks.size(); ++c) {
+            if (!chunks[c])
+                continue;
+            for (size_t i = 0; i < chunk_size; ++i)
+                if (chunks[c]->used[i])
+                    f((int) (c << chunk_bits | i), *chunks[c]->at(i));
+        }
+    }
+};
+
+#endif //P2_FDTABLE_H
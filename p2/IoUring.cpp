@@ -0,0 +1,193 @@
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+#include <unistd.h>
+#include "IoUring.h"
+
+// Linux
+
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+IoUring::IoUring(unsigned entries)
+        : sq_pending(0), buf_ring(nullptr), buf_ring_size(0), buf_base(nullptr), buf_size(0), buf_group(0) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // Broadcasts queue one send per client, so leave room for bursts.
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    ring_fd = io_uring_setup(entries, &p);
+    if (ring_fd == -1)
+        throw std::system_error(errno, std::system_category());
+    // Timed waits, Linux 5.11.
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(ring_fd);
+        throw std::system_error(ENOSYS, std::system_category());
+    }
+
+    sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+
+    sq_ptr = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        throw std::system_error(errno, std::system_category());
+
+    cq_ptr = sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ptr = mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            throw std::system_error(errno, std::system_category());
+    }
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        throw std::system_error(errno, std::system_category());
+
+    char *sq = (char *) sq_ptr, *cq = (char *) cq_ptr;
+    sq_head = (unsigned *) (sq + p.sq_off.head);
+    sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *) (sq + p.sq_off.array);
+    cq_head = (unsigned *) (cq + p.cq_off.head);
+    cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+}
+
+
+IoUring::~IoUring() {
+    if (buf_ring) {
+        munmap(buf_ring, buf_ring_size);
+        delete[] buf_base;
+    }
+    munmap(sqes, sqes_size);
+    if (cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_map_size);
+    munmap(sq_ptr, sq_map_size);
+    close(ring_fd);
+}
+
+
+struct io_uring_sqe *IoUring::sqe() {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_mask) {
+        submit();
+        tail = *sq_tail;
+    }
+
+    unsigned index = tail & sq_mask;
+    struct io_uring_sqe *e = &sqes[index];
+    memset(e, 0, sizeof(*e));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    sq_pending++;
+    return e;
+}
+
+
+void IoUring::submit(unsigned wait_nr) {
+    while (true) {
+        int n = io_uring_enter(ring_fd, sq_pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0) {
+            sq_pending -= (unsigned) n;
+            return;
+        }
+        if (errno != EINTR)
+            throw std::system_error(errno, std::system_category());
+    }
+}
+
+
+void IoUring::submit(unsigned wait_nr, int timeout_ms) {
+    if (timeout_ms < 0 || !wait_nr) {
+        submit(wait_nr);
+        return;
+    }
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t) &ts;
+
+    while (true) {
+        int n = (int) syscall(__NR_io_uring_enter, ring_fd, sq_pending, wait_nr,
+                              IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (n >= 0) {
+            sq_pending -= (unsigned) n;
+            return;
+        }
+        // Timed out with nothing submitted.
+        if (errno == ETIME)
+            return;
+        if (errno != EINTR)
+            throw std::system_error(errno, std::system_category());
+    }
+}
+
+
+void IoUring::setupBuffers(uint16_t group, unsigned count, size_t size) {
+    buf_ring_size = count * sizeof(struct io_uring_buf);
+    void *mem = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        throw std::system_error(errno, std::system_category());
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) mem;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        int err = errno;
+        munmap(mem, buf_ring_size);
+        throw std::system_error(err, std::system_category());
+    }
+
+    buf_ring = (struct io_uring_buf_ring *) mem;
+    buf_mask = count - 1;
+    buf_base = new char[count * size];
+    buf_size = size;
+    buf_group = group;
+
+    for (unsigned bid = 0; bid < count; ++bid)
+        recycleBuffer((uint16_t) bid);
+}
+
+
+void IoUring::recycleBuffer(uint16_t bid) {
+    // Not buf_ring->bufs: in C++ the header's flexible array sits behind a
+    // one-byte empty struct and lands at offset 8 instead of 0.
+    uint16_t tail = buf_ring->tail;
+    struct io_uring_buf *b = (struct io_uring_buf *) buf_ring + (tail & buf_mask);
+    b->addr = (uint64_t) buffer(bid);
+    b->len = (uint32_t) buf_size;
+    b->bid = bid;
+    __atomic_store_n(&buf_ring->tail, (uint16_t) (tail + 1), __ATOMIC_RELEASE);
+}
+
+#endif
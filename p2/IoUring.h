@@ -0,0 +1,81 @@
+#ifndef P2_IOURING_H
+#define P2_IOURING_H
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+
+// Linux
+
+// Just enough of io_uring for chatsrv, on the raw system calls (no liburing):
+// one submission and completion queue pair plus one provided buffer ring.
+class IoUring {
+    int ring_fd;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned sq_pending;  // filled in but not yet passed to the kernel
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    unsigned buf_mask;
+    char *buf_base;
+    size_t buf_size;
+    uint16_t buf_group;
+
+public:
+    explicit IoUring(unsigned entries);
+    ~IoUring();
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    // A zeroed submission entry, submitting the queue first if it is full.
+    struct io_uring_sqe *sqe();
+
+    // Passes the pending entries to the kernel and waits for at least
+    // wait_nr completions, in one io_uring_enter.
+    void submit(unsigned wait_nr = 0);
+    // The same, waiting at most timeout_ms; -1 is for ever.
+    void submit(unsigned wait_nr, int timeout_ms);
+
+    // Calls f(cqe) for every available completion, up to max, and
+    // consumes them.
+    template <class F>
+    unsigned forEachCqe(F f, unsigned max = ~0u) {
+        unsigned head = *cq_head, n = 0;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && n < max; ++head, ++n)
+            f(cqes[head & cq_mask]);
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    // Registers count buffers of size bytes as buffer group `group` for
+    // IOSQE_BUFFER_SELECT receives. count must be a power of two.
+    void setupBuffers(uint16_t group, unsigned count, size_t size);
+    char *buffer(uint16_t bid) const { return buf_base + (size_t) bid * buf_size; }
+    // Hands a consumed buffer back to the kernel.
+    void recycleBuffer(uint16_t bid);
+    uint16_t bufferGroup() const { return buf_group; }
+};
+
+#endif
+
+#endif //P2_IOURING_H
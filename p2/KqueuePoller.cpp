@@ -0,0 +1,93 @@
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+#include "Poller.h"
+
+// Mac OS X
+
+
+class KqueuePoller : public Poller {
+    int kqueue_fd;
+    std::vector<struct kevent> ready;  // reused by every wait()
+
+    void change(int fd, short filter, unsigned short action) {
+        struct kevent ev;
+        EV_SET(&ev, fd, filter, action, 0, 0, 0);
+        if (kevent(kqueue_fd, &ev, 1, NULL, 0, NULL) == -1 && !(action & EV_DELETE))
+            throw std::system_error(errno, std::system_category());
+    }
+
+    void set(int fd, unsigned flags) {
+        unsigned short clear = (flags & PollEdge) ? EV_CLEAR : 0;
+        change(fd, EVFILT_READ, (flags & PollIn) ? EV_ADD | EV_ENABLE | clear : EV_ADD | EV_DISABLE);
+        change(fd, EVFILT_WRITE, (flags & PollOut) ? EV_ADD | EV_ENABLE | clear : EV_ADD | EV_DISABLE);
+    }
+
+public:
+    KqueuePoller() {
+        kqueue_fd = kqueue();
+        if (kqueue_fd == -1)
+            throw std::system_error(errno, std::system_category());
+    }
+
+    ~KqueuePoller() {
+        close(kqueue_fd);
+    }
+
+    void addListener(int fd) {
+        change(fd, EVFILT_READ, EV_ADD);
+    }
+
+    void add(int fd, unsigned flags) {
+        set(fd, flags);
+    }
+
+    void modify(int fd, unsigned flags) {
+        set(fd, flags);
+    }
+
+    void remove(int fd) {
+        change(fd, EVFILT_READ, EV_DELETE);
+        change(fd, EVFILT_WRITE, EV_DELETE);
+    }
+
+    int wait(PollEvent *events, int max, int timeout_ms) {
+        if ((int) ready.size() < max)
+            ready.resize(max);
+
+        struct timespec timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+        int n = kevent(kqueue_fd, NULL, 0, ready.data(), max, timeout_ms < 0 ? NULL : &timeout);
+        if (n == -1) {
+            if (errno == EINTR)
+                return 0;
+            throw std::system_error(errno, std::system_category());
+        }
+
+        // kqueue reports read and write readiness as separate events. A
+        // disabled filter reports no EOF either: with reading off, a
+        // hang-up only shows up while writing is on.
+        for (int i = 0; i < n; ++i) {
+            events[i].fd = (int) ready[i].ident;
+            events[i].flags = ready[i].filter == EVFILT_WRITE ? PollOut : PollIn;
+            if (ready[i].flags & (EV_EOF | EV_ERROR))
+                events[i].flags |= PollHup;
+        }
+        return n;
+    }
+
+    const char *name() const { return "kqueue"; }
+};
+
+
+Poller *Poller::create() {
+    return new KqueuePoller();
+}
+
+#endif
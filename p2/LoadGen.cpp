@@ -0,0 +1,598 @@
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+#include "Poller.h"
+#include "ReadRing.h"
+
+// Linux, Mac OS X
+//
+// Load generator for chatsrv. Opens many connections from one event loop,
+// sends timestamped messages from some of them at a fixed total rate, and
+// measures on every receiving connection how long each message took to
+// come back. Slow clients read at a trickle to see how the server treats
+// them. Prints a JSON report at the end. The timestamps are taken from this
+// host's monotonic clock, so the server may be remote, the clients may not.
+//
+// With --idle nobody sends: together with --server-pid this measures what
+// an idle connection costs the server, as resident memory per connection.
+
+#define MAX_EVENTS 1024
+#define MAX_CONNECTING 512      // connects in flight
+#define SETTLE_MS 200           // after connecting, before sending
+#define SLOW_INTERVAL_MS 100    // how often slow clients read
+#define DRAIN_MS 2000           // waiting for stragglers after the last send
+#define MIN_SIZE 48             // room for the header
+#define PER_SOURCE 20000        // connections per loopback source address
+
+// Linux has no SO_NOSIGPIPE, only a per-call flag.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+
+static uint64_t nowNs() {
+    auto since = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(since).count();
+}
+
+
+// Latency histogram in microseconds: exact below 64, then 32 buckets per
+// power of two, so any reported value is within about 3%.
+class Histogram {
+    static const int sub_bits = 6;
+    static const int half = 1 << (sub_bits - 1);
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max_value;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < (1u << sub_bits))
+            return value;
+        int shift = 63 - __builtin_clzll(value) - (sub_bits - 1);
+        return (size_t) shift * half + (value >> shift);
+    }
+
+    // The largest value of the bucket.
+    static uint64_t valueOf(size_t bucket) {
+        if (bucket < (1u << sub_bits))
+            return bucket;
+        int shift = (int) (bucket / half) - 1;
+        uint64_t mantissa = bucket - (size_t) shift * half;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+public:
+    Histogram() : counts(bucketOf(UINT64_MAX) + 1), total(0), max_value(0) { }
+
+    void add(uint64_t value) {
+        counts[bucketOf(value)]++;
+        total++;
+        if (value > max_value)
+            max_value = value;
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = (uint64_t) (p * total + 0.999999), seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank && seen)
+                return std::min(valueOf(i), max_value);
+        }
+        return max_value;
+    }
+
+    uint64_t max() const { return max_value; }
+    uint64_t count() const { return total; }
+};
+
+
+class LoadGen {
+public:
+    struct Options {
+        std::string host;
+        int port;
+        int clients;
+        int senders;      // of the fast clients
+        int slow;         // clients that read at slow_rate
+        double rate;      // messages per second, all senders together
+        size_t size;      // bytes per message, '\n' included
+        double duration;  // seconds of sending
+        size_t slow_rate; // bytes per second per slow client
+        std::string room; // joined by every client if not empty
+        std::string report;  // stdout if empty
+        int server_pid;   // to report the server's RSS, 0 for none
+
+        Options() : host("127.0.0.1"), port(3100), clients(1000), senders(10), slow(0),
+                    rate(1000), size(64), duration(10), slow_rate(1024), server_pid(0) { }
+    };
+
+private:
+    struct Conn {
+        int fd;      // -1 once closed
+        bool slow;
+        bool connecting;  // until the first event on fd
+        ReadRing in;
+        std::string out;  // the rest of a partly sent message
+    };
+
+    Options opt;
+    std::unique_ptr<Poller> poller;
+    std::vector<Conn> conns;
+    std::vector<int> by_fd;  // fd to index in conns
+    std::vector<int> senders;
+    size_t turn;         // next sender
+
+    uint64_t start_ns;   // of sending
+    uint64_t last_delivery_ns;
+    uint64_t sent;
+    uint64_t skipped;    // sender still busy with the previous message
+    uint64_t delivered;
+    uint64_t fast_closed;
+    uint64_t slow_closed;
+    uint64_t slow_bytes;
+    double first_eviction;  // seconds into sending when a close was seen, -1 if none
+    double last_eviction;
+    int connect_failed;
+    Histogram latency;
+    long rss_before;  // kB, -1 if unknown
+    long rss_after;
+
+    Conn &conn(int fd) { return conns[by_fd[fd]]; }
+
+    void raiseFileLimit();
+    int startConnect(int index, bool slow);
+    long serverRss();
+    void connectAll();
+    void closeConn(Conn &c, uint64_t now);
+    void sendLine(Conn &c, const char *line, size_t size);
+    bool flush(Conn &c);
+    void readFast(Conn &c, uint64_t now);
+    void readSlow(Conn &c, size_t budget, uint64_t now);
+    void sendDue(uint64_t now);
+    void handle(const PollEvent &event, uint64_t now);
+    void pump(int timeout_ms, uint64_t now);
+    void writeReport();
+
+public:
+    explicit LoadGen(const Options &_opt);
+    void run();
+};
+
+
+LoadGen::LoadGen(const Options &_opt)
+        : opt(_opt), poller(Poller::create()), turn(0), start_ns(0), last_delivery_ns(0), sent(0),
+          skipped(0), delivered(0), fast_closed(0), slow_closed(0), slow_bytes(0),
+          first_eviction(-1), last_eviction(-1), connect_failed(0), rss_before(-1), rss_after(-1) { }
+
+
+// Tens of thousands of sockets need more than the usual 1024 descriptors.
+void LoadGen::raiseFileLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+        throw std::system_error(errno, std::system_category());
+    if (limit.rlim_cur >= (rlim_t) opt.clients + 16)
+        return;
+    limit.rlim_cur = std::min(limit.rlim_max, (rlim_t) opt.clients + 16);
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur < (rlim_t) opt.clients + 16)
+        fprintf(stderr, "loadgen: only %llu descriptors allowed\n", (unsigned long long) limit.rlim_cur);
+}
+
+
+// Linux
+//
+// Resident set of the server in kB, -1 if unknown.
+long LoadGen::serverRss() {
+    if (!opt.server_pid)
+        return -1;
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/%d/status", opt.server_pid);
+    FILE *status = fopen(path, "r");
+    if (!status)
+        return -1;
+    long rss = -1;
+    while (fgets(line, sizeof(line), status))
+        if (sscanf(line, "VmRSS: %ld kB", &rss) == 1)
+            break;
+    fclose(status);
+    return rss;
+}
+
+
+int LoadGen::startConnect(int index, bool slow) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    if (!inet_aton(opt.host.c_str(), &addr.sin_addr))
+        throw std::system_error(EINVAL, std::system_category());
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    // One source address has about 28k ephemeral ports. On loopback the
+    // whole of 127/8 is there, so spread over 127.0.0.1, 127.0.0.2, ...
+    if ((ntohl(addr.sin_addr.s_addr) >> 24) == 127 && opt.clients > PER_SOURCE) {
+        struct sockaddr_in source;
+        memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = htonl(0x7f000001 + index / PER_SOURCE);
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        int optval = 1;  // pick the port at connect(), per destination
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &optval, sizeof(optval));
+#endif
+        if (bind(fd, (struct sockaddr *) &source, sizeof(source)) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
+#endif
+    // A small window, so that the server's queue fills rather than ours.
+    // It has to be set before connecting to count.
+    int size = 4096;
+    if (slow)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// Non-blocking connects, at most MAX_CONNECTING at a time. Fast clients
+// stay registered for reading, edge-triggered; slow ones are read on a
+// timer instead and leave the poller.
+void LoadGen::connectAll() {
+    PollEvent events[MAX_EVENTS];
+    int started = 0, pending = 0, done = 0;
+
+    while (done < opt.clients) {
+        while (started < opt.clients && pending < MAX_CONNECTING) {
+            bool slow = started >= opt.clients - opt.slow;
+            int fd = startConnect(started, slow);
+            started++;
+            if (fd == -1) {
+                connect_failed++;
+                done++;
+                continue;
+            }
+            if ((size_t) fd >= by_fd.size())
+                by_fd.resize(fd + 1, -1);
+            by_fd[fd] = (int) conns.size();
+            conns.push_back(Conn());
+            conns.back().fd = fd;
+            conns.back().slow = slow;
+            conns.back().connecting = true;
+            poller->add(fd, PollOut);
+            pending++;
+        }
+
+        int n = poller->wait(events, MAX_EVENTS, 1000);
+        for (int i = 0; i < n; ++i) {
+            Conn &c = conn(events[i].fd);
+            // Already connected: the welcome line, or a join sent in part.
+            if (!c.connecting) {
+                handle(events[i], nowNs());
+                continue;
+            }
+            c.connecting = false;
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            pending--;
+            done++;
+
+            if (error) {
+                poller->remove(c.fd);
+                close(c.fd);
+                c.fd = -1;
+                connect_failed++;
+                continue;
+            }
+            if (c.slow) {
+                poller->remove(c.fd);
+            } else {
+                poller->modify(c.fd, PollIn | PollEdge);
+                if ((int) senders.size() < opt.senders)
+                    senders.push_back(by_fd[c.fd]);
+            }
+            if (!opt.room.empty()) {
+                std::string join = "/join " + opt.room + "\n";
+                sendLine(c, join.data(), join.size());
+            }
+        }
+    }
+}
+
+
+void LoadGen::closeConn(Conn &c, uint64_t now) {
+    if (!c.slow) {
+        poller->remove(c.fd);
+        fast_closed++;
+    } else {
+        slow_closed++;
+        double at = start_ns ? (double) (now - start_ns) / 1e9 : 0;
+        if (first_eviction < 0)
+            first_eviction = at;
+        last_eviction = at;
+    }
+    close(c.fd);
+    c.fd = -1;
+}
+
+
+void LoadGen::sendLine(Conn &c, const char *line, size_t size) {
+    ssize_t n = send(c.fd, line, size, SEND_FLAGS);
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return;  // the read side notices
+    if (n < 0)
+        n = 0;
+    if ((size_t) n < size) {
+        c.out.assign(line + n, size - n);
+        if (!c.slow)
+            poller->modify(c.fd, PollIn | PollOut | PollEdge);
+    }
+}
+
+
+// Returns true once nothing is left to send.
+bool LoadGen::flush(Conn &c) {
+    while (!c.out.empty()) {
+        ssize_t n = send(c.fd, c.out.data(), c.out.size(), SEND_FLAGS);
+        if (n == -1)
+            return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+        c.out.erase(0, n);
+    }
+    poller->modify(c.fd, PollIn | PollEdge);
+    return true;
+}
+
+
+void LoadGen::readFast(Conn &c, uint64_t now) {
+    while (true) {
+        ssize_t n = c.in.fill(c.fd);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            closeConn(c, now);
+            return;
+        }
+
+        Message msg;
+        while (c.in.next(msg)) {
+            unsigned sender;
+            uint64_t seq, stamp;
+            // Ends with '\n', so sscanf() stops inside the message.
+            if (msg.size() < 3 || memcmp(msg.data(), "LG ", 3) ||
+                sscanf(msg.data(), "LG %u %" SCNu64 " %" SCNu64, &sender, &seq, &stamp) != 3)
+                continue;  // the welcome line
+            latency.add(now > stamp ? (now - stamp) / 1000 : 0);
+            delivered++;
+            last_delivery_ns = now;
+        }
+    }
+}
+
+
+// A slow client reads at most budget bytes, and only counts them.
+void LoadGen::readSlow(Conn &c, size_t budget, uint64_t now) {
+    char buf[4096];
+    while (budget) {
+        ssize_t n = recv(c.fd, buf, std::min(budget, sizeof(buf)), 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            closeConn(c, now);
+            return;
+        }
+        slow_bytes += n;
+        budget -= n;
+    }
+}
+
+
+// Sends whatever the rate says is due by now, round robin over the senders.
+// A sender still busy with its previous message skips its turn.
+void LoadGen::sendDue(uint64_t now) {
+    if (senders.empty())
+        return;
+    uint64_t due = (uint64_t) (opt.rate * (double) (now - start_ns) / 1e9);
+
+    char line[MAX_MSG];
+    while (sent + skipped < due) {
+        size_t sender = turn++ % senders.size();
+        Conn &c = conns[senders[sender]];
+        if (c.fd == -1 || !c.out.empty()) {
+            skipped++;
+            continue;
+        }
+        int header = snprintf(line, sizeof(line), "LG %zu %" PRIu64 " %" PRIu64 " ",
+                              sender, sent, nowNs());
+        memset(line + header, 'x', opt.size - 1 - header);
+        line[opt.size - 1] = '\n';
+        sendLine(c, line, opt.size);
+        sent++;
+    }
+}
+
+
+// An event on a connected fast client.
+void LoadGen::handle(const PollEvent &event, uint64_t now) {
+    Conn &c = conn(event.fd);
+    if (c.fd == -1)
+        return;
+    if ((event.flags & PollOut) && !flush(c))
+        return;
+    if (event.flags & PollIn)
+        readFast(c, now);
+}
+
+
+void LoadGen::pump(int timeout_ms, uint64_t now) {
+    PollEvent events[MAX_EVENTS];
+    int n = poller->wait(events, MAX_EVENTS, timeout_ms);
+    now = nowNs();
+    for (int i = 0; i < n; ++i)
+        handle(events[i], now);
+}
+
+
+void LoadGen::run() {
+    raiseFileLimit();
+    rss_before = serverRss();
+    connectAll();
+
+    // Let the welcome lines and joins go through first.
+    uint64_t until = nowNs() + SETTLE_MS * 1000000ull;
+    while (nowNs() < until)
+        pump(10, nowNs());
+
+    start_ns = nowNs();
+    uint64_t stop = start_ns + (uint64_t) (opt.duration * 1e9);
+    uint64_t next_slow = start_ns;
+    size_t slow_budget = opt.slow_rate * SLOW_INTERVAL_MS / 1000;
+
+    uint64_t now = start_ns;
+    while (now < stop) {
+        sendDue(now);
+        pump(1, now);
+        now = nowNs();
+        if (now >= next_slow) {
+            for (Conn &c : conns)
+                if (c.slow && c.fd != -1)
+                    readSlow(c, slow_budget, now);
+            next_slow = now + SLOW_INTERVAL_MS * 1000000ull;
+        }
+    }
+
+    rss_after = serverRss();
+
+    // Stragglers, then whatever the slow clients still have coming: a
+    // server that evicted them has closed the connection behind it.
+    uint64_t fast_open = 0;
+    for (Conn &c : conns)
+        fast_open += c.fd != -1 && !c.slow;
+    until = nowNs() + DRAIN_MS * 1000000ull;
+    while (nowNs() < until && delivered < sent * fast_open)
+        pump(10, nowNs());
+    for (Conn &c : conns)
+        if (c.slow && c.fd != -1)
+            readSlow(c, SIZE_MAX, nowNs());
+
+    writeReport();
+}
+
+
+void LoadGen::writeReport() {
+    FILE *out = stdout;
+    if (!opt.report.empty() && !(out = fopen(opt.report.c_str(), "w")))
+        throw std::system_error(errno, std::system_category());
+
+    int fast = opt.clients - opt.slow;
+    double seconds = last_delivery_ns > start_ns ? (double) (last_delivery_ns - start_ns) / 1e9 : 0;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"server\": \"%s:%d\",\n", opt.host.c_str(), opt.port);
+    fprintf(out, "  \"room\": \"%s\",\n", opt.room.c_str());
+    fprintf(out, "  \"clients\": %d,\n", opt.clients);
+    fprintf(out, "  \"connect_failed\": %d,\n", connect_failed);
+    fprintf(out, "  \"senders\": %zu,\n", senders.size());
+    fprintf(out, "  \"rate\": %.1f,\n", opt.rate);
+    fprintf(out, "  \"size\": %zu,\n", opt.size);
+    fprintf(out, "  \"duration_s\": %.3f,\n", opt.duration);
+    fprintf(out, "  \"sent\": %" PRIu64 ",\n", sent);
+    fprintf(out, "  \"skipped\": %" PRIu64 ",\n", skipped);
+    fprintf(out, "  \"delivered\": %" PRIu64 ",\n", delivered);
+    fprintf(out, "  \"expected\": %" PRIu64 ",\n", sent * (uint64_t) fast);
+    fprintf(out, "  \"delivered_per_sec\": %.1f,\n", seconds ? delivered / seconds : 0);
+    fprintf(out, "  \"latency_us\": {\"p50\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64
+                 ", \"max\": %" PRIu64 "},\n",
+            latency.percentile(0.5), latency.percentile(0.99), latency.percentile(0.999), latency.max());
+    fprintf(out, "  \"fast_disconnected\": %" PRIu64 ",\n", fast_closed);
+    int connected = opt.clients - connect_failed;
+    if (rss_before >= 0 && rss_after >= 0 && connected)
+        fprintf(out, "  \"server_rss_kb\": {\"before\": %ld, \"after\": %ld, \"per_connection_bytes\": %.0f},\n",
+                rss_before, rss_after, (rss_after - rss_before) * 1024.0 / connected);
+    fprintf(out, "  \"slow\": {\"clients\": %d, \"read_rate\": %zu, \"bytes_read\": %" PRIu64
+                 ", \"evicted\": %" PRIu64 ", \"first_close_seen_s\": %.3f, \"last_close_seen_s\": %.3f}\n",
+            opt.slow, opt.slow_rate, slow_bytes, slow_closed, first_eviction, last_eviction);
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+}
+
+
+int main(int argc, char **argv) {
+    LoadGen::Options opt;
+
+    for (int i = 1; i < argc; ++i) {
+        bool more = i + 1 < argc;
+        if (!strcmp(argv[i], "--host") && more) {
+            opt.host = argv[++i];
+        } else if (!strcmp(argv[i], "--port") && more && atoi(argv[i + 1]) > 0) {
+            opt.port = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--clients") && more && atoi(argv[i + 1]) > 0) {
+            opt.clients = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--senders") && more && atoi(argv[i + 1]) >= 0) {
+            opt.senders = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--slow") && more && atoi(argv[i + 1]) >= 0) {
+            opt.slow = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--rate") && more && atof(argv[i + 1]) > 0) {
+            opt.rate = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && more && atoi(argv[i + 1]) >= MIN_SIZE &&
+                   atoi(argv[i + 1]) <= MAX_MSG) {
+            opt.size = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--duration") && more && atof(argv[i + 1]) > 0) {
+            opt.duration = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--slow-rate") && more && atoi(argv[i + 1]) >= 0) {
+            opt.slow_rate = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--room") && more) {
+            opt.room = argv[++i];
+        } else if (!strcmp(argv[i], "--report") && more) {
+            opt.report = argv[++i];
+        } else if (!strcmp(argv[i], "--idle")) {
+            opt.senders = 0;
+        } else if (!strcmp(argv[i], "--server-pid") && more && atoi(argv[i + 1]) > 0) {
+            opt.server_pid = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--host IP] [--port N] [--clients N] [--senders N] [--slow N] "
+                    "[--rate MSG/S] [--size %d..%d] [--duration SEC] [--slow-rate BYTES/S] "
+                    "[--room NAME] [--report PATH] [--idle] [--server-pid PID]\n", argv[0], MIN_SIZE, MAX_MSG);
+            return 1;
+        }
+    }
+    if (opt.slow > opt.clients)
+        opt.slow = opt.clients;
+
+    LoadGen app(opt);
+    app.run();
+    return 0;
+}
@@ -0,0 +1,186 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include "Logger.h"
+#include "ReadRing.h"
+
+#define LOG_BATCH (64 * 1024)  // bytes formatted before a write()
+
+
+Logger::Logger(int _fd, size_t capacity, Policy _policy)
+        : fd(_fd), policy(_policy), enqueue_pos(0), dequeue_pos(0),
+          dropped_new(0), dropped_total(0), writer_idle(false), stopping(false) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    cells.reset(new Cell[size]);
+    mask = size - 1;
+    for (size_t i = 0; i < size; ++i)
+        cells[i].seq.store(i, std::memory_order_relaxed);
+
+    flushing.clear();
+    batch.reserve(LOG_BATCH + 2 * MAX_MSG);
+}
+
+
+Logger::~Logger() {
+    if (writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            stopping = true;
+        }
+        writer_cv.notify_one();
+        writer.join();
+    }
+    flush();
+}
+
+
+bool Logger::tryPush(Kind kind, const Message &msg) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+
+    while (true) {
+        cell = &cells[pos & mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;  // full
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->kind = kind;
+    cell->msg = msg;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+
+void Logger::log(Kind kind, const Message &msg) {
+    while (!tryPush(kind, msg)) {
+        if (policy == Drop) {
+            dropped_new.fetch_add(1, std::memory_order_relaxed);
+            dropped_total.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        // Block: make room ourselves unless a writer is on it.
+        if (writer.joinable())
+            std::this_thread::yield();
+        else
+            flush();
+    }
+
+    if (writer.joinable() && writer_idle.load(std::memory_order_relaxed))
+        writer_cv.notify_one();
+}
+
+
+void Logger::note(const char *text) {
+    log(Note, Message(text, strlen(text)));
+}
+
+
+void Logger::commit() {
+    if (!writer.joinable())
+        flush();
+}
+
+
+void Logger::format(Kind kind, const Message &msg) {
+    switch (kind) {
+        case Accepted:
+            batch.append("LOG: accepted connection\n");
+            break;
+        case Terminated:
+            batch.append("LOG: connection terminated\n");
+            break;
+        case Received:
+            batch.append("LOG MSG: ");
+            batch.append(msg.data(), msg.size());
+            break;
+        case Note:
+            batch.append(msg.data(), msg.size());
+            break;
+    }
+}
+
+
+void Logger::writeBatch() {
+    size_t done = 0;
+    while (done < batch.size()) {
+        ssize_t n = write(fd, batch.data() + done, batch.size() - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;  // nowhere to log to; carry on serving
+        done += n;
+    }
+    batch.clear();
+}
+
+
+// Drains the ring. Only one thread at a time consumes; any other caller
+// returns at once and leaves the records to it. The consumer may have
+// looked past a record pushed by such a caller, so once it has let go it
+// checks again and takes over if that record is still waiting.
+void Logger::flush() {
+    while (!flushing.test_and_set()) {
+        while (true) {
+            Cell *cell = &cells[dequeue_pos & mask];
+            if (cell->seq.load(std::memory_order_acquire) != dequeue_pos + 1)
+                break;
+
+            format(cell->kind, cell->msg);
+            cell->msg = Message();
+            cell->seq.store(dequeue_pos + mask + 1, std::memory_order_release);
+            dequeue_pos++;
+
+            if (batch.size() >= LOG_BATCH)
+                writeBatch();
+        }
+
+        size_t dropped = dropped_new.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            char line[64];
+            snprintf(line, sizeof(line), "LOG: %zu records dropped\n", dropped);
+            batch.append(line);
+        }
+        if (!batch.empty())
+            writeBatch();
+
+        size_t pos = dequeue_pos;
+        flushing.clear();
+        if (cells[pos & mask].seq.load() != pos + 1)
+            return;
+    }
+}
+
+
+void Logger::startWriter() {
+    writer = std::thread(&Logger::writerLoop, this);
+}
+
+
+// Sleeps when there is nothing to write; log() wakes it. A wake-up lost
+// between the check and the wait costs at most the 10 ms timeout.
+void Logger::writerLoop() {
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    while (!stopping) {
+        lock.unlock();
+        flush();
+        lock.lock();
+
+        writer_idle.store(true, std::memory_order_relaxed);
+        writer_cv.wait_for(lock, std::chrono::milliseconds(10));
+        writer_idle.store(false, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef P2_LOGGER_H
+#define P2_LOGGER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "Message.h"
+
+
+// Log lines off the event loops' path. log() only claims a slot of a
+// bounded lock-free ring (Vyukov's bounded queue) and stores the record;
+// message text is referenced, not copied. Records are formatted and written
+// in batches with one write() each, either by the loops themselves once
+// per iteration (commit()) or, after startWriter(), by a background thread.
+class Logger {
+public:
+    enum Kind {
+        Accepted,    // "accepted connection"
+        Terminated,  // "connection terminated"
+        Received,    // the message text
+        Note,        // the text as is
+    };
+
+    // What log() does when the ring is full.
+    enum Policy {
+        Drop,   // lose the record; the count is logged later
+        Block,  // wait for room
+    };
+
+    Logger(int _fd, size_t capacity, Policy _policy);
+    ~Logger();
+
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+    // Any thread.
+    void log(Kind kind, const Message &msg = Message());
+    void note(const char *text);
+
+    // Called by each event loop at the end of an iteration.
+    void commit();
+
+    // Moves writing to a background thread.
+    void startWriter();
+
+    size_t dropped() const { return dropped_total.load(std::memory_order_relaxed); }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        Kind kind;
+        Message msg;
+    };
+
+    int fd;
+    Policy policy;
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    std::atomic<size_t> enqueue_pos;
+    size_t dequeue_pos;                // by the holder of `flushing` only
+    std::atomic_flag flushing;         // one consumer at a time
+    std::atomic<size_t> dropped_new;   // not reported yet
+    std::atomic<size_t> dropped_total;
+    std::string batch;
+
+    std::thread writer;
+    std::mutex writer_mutex;
+    std::condition_variable writer_cv;
+    std::atomic<bool> writer_idle;
+    bool stopping;
+
+    bool tryPush(Kind kind, const Message &msg);
+    void flush();
+    void format(Kind kind, const Message &msg);
+    void writeBatch();
+    void writerLoop();
+};
+
+#endif //P2_LOGGER_H
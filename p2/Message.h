@@ -0,0 +1,104 @@
+#ifndef P2_MESSAGE_H
+#define P2_MESSAGE_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/uio.h>
+
+
+// Immutable message bytes shared by every outbound queue that holds them.
+// The count and the bytes are one allocation, freed with the last
+// reference, so a broadcast costs one copy whatever the number of
+// recipients.
+class Message {
+    struct Block {
+        long refs;
+        size_t size;
+        char data[1];
+    };
+
+    Block *block;
+
+    // Atomic: with several shards one message is queued from every thread.
+    void acquire() {
+        if (block)
+            __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    void release() {
+        if (block && __atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0)
+            std::free(block);
+        block = nullptr;
+    }
+
+    void init(const struct iovec *iov, int count) {
+        size_t size = 0;
+        for (int i = 0; i < count; ++i)
+            size += iov[i].iov_len;
+
+        block = (Block *) std::malloc(offsetof(Block, data) + size);
+        if (!block)
+            throw std::bad_alloc();
+        block->refs = 1;
+        block->size = size;
+
+        char *p = block->data;
+        for (int i = 0; i < count; ++i) {
+            std::memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+    }
+
+public:
+    Message() : block(nullptr) { }
+
+    Message(const char *data, size_t size) {
+        struct iovec iov;
+        iov.iov_base = (void *) data;
+        iov.iov_len = size;
+        init(&iov, 1);
+    }
+
+    // The pieces concatenated.
+    Message(const struct iovec *iov, int count) {
+        init(iov, count);
+    }
+
+    Message(const Message &other) : block(other.block) {
+        acquire();
+    }
+
+    Message(Message &&other) noexcept : block(other.block) {
+        other.block = nullptr;
+    }
+
+    Message &operator=(const Message &other) {
+        if (block != other.block) {
+            release();
+            block = other.block;
+            acquire();
+        }
+        return *this;
+    }
+
+    Message &operator=(Message &&other) noexcept {
+        if (this != &other) {
+            release();
+            block = other.block;
+            other.block = nullptr;
+        }
+        return *this;
+    }
+
+    ~Message() {
+        release();
+    }
+
+    const char *data() const { return block ? block->data : nullptr; }
+    size_t size() const { return block ? block->size : 0; }
+    long refs() const { return block ? __atomic_load_n(&block->refs, __ATOMIC_RELAXED) : 0; }
+};
+
+#endif //P2_MESSAGE_H
@@ -0,0 +1,109 @@
+#ifndef P2_MESSAGEQUEUE_H
+#define P2_MESSAGEQUEUE_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include "BlockPool.h"
+#include "Message.h"
+
+
+// Outbound queue of a connection: Message references in a list of pool
+// blocks, about 500 to a block. Blocks are taken as the queue grows and
+// given back as it drains; an empty queue owns no memory, unlike a
+// std::deque, which allocates on construction.
+class MessageQueue {
+    struct Block {
+        Block *next;
+        Message items[1];  // per_block of them
+    };
+
+    static const size_t per_block = (POOL_BLOCK - offsetof(Block, items)) / sizeof(Message);
+
+    Block *first;
+    Block *last;
+    size_t head;   // index of the front in first
+    size_t tail;   // one past the back in last
+    size_t count;
+
+    Message *slot(Block *block, size_t index) { return &block->items[0] + index; }
+
+public:
+    MessageQueue() : first(nullptr), last(nullptr), head(0), tail(0), count(0) { }
+
+    ~MessageQueue() {
+        clear();
+    }
+
+    MessageQueue(MessageQueue &&other) noexcept
+            : first(other.first), last(other.last), head(other.head), tail(other.tail), count(other.count) {
+        other.first = other.last = nullptr;
+        other.head = other.tail = other.count = 0;
+    }
+
+    MessageQueue &operator=(MessageQueue &&other) noexcept {
+        std::swap(first, other.first);
+        std::swap(last, other.last);
+        std::swap(head, other.head);
+        std::swap(tail, other.tail);
+        std::swap(count, other.count);
+        return *this;
+    }
+
+    MessageQueue(const MessageQueue &) = delete;
+    MessageQueue &operator=(const MessageQueue &) = delete;
+
+    bool empty() const { return !count; }
+    size_t size() const { return count; }
+
+    void push_back(const Message &msg) {
+        if (!last || tail == per_block) {
+            Block *block = (Block *) BlockPool::get();
+            block->next = nullptr;
+            if (last)
+                last->next = block;
+            else
+                first = block;
+            last = block;
+            tail = 0;
+        }
+        new (slot(last, tail++)) Message(msg);
+        count++;
+    }
+
+    Message &front() { return *slot(first, head); }
+
+    // The i-th message from the front; cheap for small i.
+    Message &at(size_t i) {
+        Block *block = first;
+        i += head;
+        while (i >= per_block) {
+            block = block->next;
+            i -= per_block;
+        }
+        return *slot(block, i);
+    }
+
+    void pop_front() {
+        slot(first, head++)->~Message();
+        count--;
+
+        if (!count) {
+            BlockPool::put(first);
+            first = last = nullptr;
+            head = tail = 0;
+        } else if (head == per_block) {
+            Block *block = first;
+            first = first->next;
+            BlockPool::put(block);
+            head = 0;
+        }
+    }
+
+    void clear() {
+        while (count)
+            pop_front();
+    }
+};
+
+#endif //P2_MESSAGEQUEUE_H
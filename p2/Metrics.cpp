@@ -0,0 +1,178 @@
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include "Metrics.h"
+
+// Linux, Mac OS X
+
+
+uint64_t monotonicNs() {
+    auto since = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(since).count();
+}
+
+
+void LatencyHistogram::record(uint64_t ns) {
+    uint64_t us = (ns + 999) / 1000;  // rounded up: buckets are "at most"
+    int i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (i > buckets - 1)
+        i = buckets - 1;
+    counts[i].add(1);
+    sum_ns.add(ns);
+}
+
+
+namespace {
+
+void header(std::string &out, const char *name, const char *type, const char *help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+
+void sample(std::string &out, const char *name, const char *labels, const char *value) {
+    out += name;
+    if (*labels) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += value;
+    out += '\n';
+}
+
+
+void integer(std::string &out, const char *name, const char *labels, uint64_t value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%" PRIu64, value);
+    sample(out, name, labels, text);
+}
+
+
+typedef uint64_t (*Read)(const LoopMetrics &);
+
+// One sample per loop.
+void perLoop(std::string &out, const std::vector<std::unique_ptr<LoopMetrics>> &loops,
+             const char *name, const char *type, const char *help, Read read) {
+    header(out, name, type, help);
+    char labels[32];
+    for (size_t i = 0; i < loops.size(); ++i) {
+        snprintf(labels, sizeof(labels), "loop=\"%zu\"", i);
+        integer(out, name, labels, read(*loops[i]));
+    }
+}
+
+
+// Reasons of one counter, such as evictions, as one family.
+void perLoopReasons(std::string &out, const std::vector<std::unique_ptr<LoopMetrics>> &loops,
+                    const char *name, const char *help, const char *const *reasons, const Read *reads, int count) {
+    header(out, name, "counter", help);
+    char labels[64];
+    for (size_t i = 0; i < loops.size(); ++i)
+        for (int r = 0; r < count; ++r) {
+            snprintf(labels, sizeof(labels), "loop=\"%zu\",reason=\"%s\"", i, reasons[r]);
+            integer(out, name, labels, reads[r](*loops[i]));
+        }
+}
+
+
+void histogram(std::string &out, const std::vector<std::unique_ptr<LoopMetrics>> &loops,
+               const char *name, const char *help, const LatencyHistogram LoopMetrics::*member) {
+    header(out, name, "histogram", help);
+    std::string bucket = std::string(name) + "_bucket";
+    std::string sum = std::string(name) + "_sum";
+    std::string count = std::string(name) + "_count";
+    char labels[64], value[32];
+
+    for (size_t i = 0; i < loops.size(); ++i) {
+        const LatencyHistogram &h = (*loops[i]).*member;
+        uint64_t total = 0;
+        for (int b = 0; b < LatencyHistogram::buckets; ++b) {
+            total += h.count(b);
+            if (b < LatencyHistogram::buckets - 1)
+                snprintf(labels, sizeof(labels), "loop=\"%zu\",le=\"%g\"", i, LatencyHistogram::boundUs(b) / 1e6);
+            else
+                snprintf(labels, sizeof(labels), "loop=\"%zu\",le=\"+Inf\"", i);
+            integer(out, bucket.c_str(), labels, total);
+        }
+
+        snprintf(labels, sizeof(labels), "loop=\"%zu\"", i);
+        snprintf(value, sizeof(value), "%.9f", h.sumNs() / 1e9);
+        sample(out, sum.c_str(), labels, value);
+        integer(out, count.c_str(), labels, total);
+    }
+}
+
+}
+
+
+// Rates are left to the scraper: rate() over the _total counters.
+std::string formatMetrics(const std::vector<std::unique_ptr<LoopMetrics>> &loops, const GlobalMetrics &global) {
+    std::string out;
+
+    // closes first: read later, accepts can only be larger.
+    perLoop(out, loops, "chatsrv_connections", "gauge", "Open client connections.",
+            [](const LoopMetrics &m) { uint64_t closes = m.closes.get(); return m.accepts.get() - closes; });
+    perLoop(out, loops, "chatsrv_accepts_total", "counter", "Connections accepted.",
+            [](const LoopMetrics &m) { return m.accepts.get(); });
+    perLoop(out, loops, "chatsrv_messages_in_total", "counter", "Messages read from clients.",
+            [](const LoopMetrics &m) { return m.messages_in.get(); });
+    perLoop(out, loops, "chatsrv_bytes_in_total", "counter", "Bytes read from clients.",
+            [](const LoopMetrics &m) { return m.bytes_in.get(); });
+    perLoop(out, loops, "chatsrv_messages_out_total", "counter", "Messages queued to clients, one per recipient.",
+            [](const LoopMetrics &m) { return m.messages_out.get(); });
+    perLoop(out, loops, "chatsrv_bytes_out_total", "counter", "Bytes written to clients.",
+            [](const LoopMetrics &m) { return m.bytes_out.get(); });
+    perLoop(out, loops, "chatsrv_writes_total", "counter", "Send calls writing to clients.",
+            [](const LoopMetrics &m) { return m.writes.get(); });
+
+    static const char *const evictions[] = {"idle", "stall", "overflow"};
+    static const Read eviction_reads[] = {
+        [](const LoopMetrics &m) { return m.idle_evictions.get(); },
+        [](const LoopMetrics &m) { return m.stall_evictions.get(); },
+        [](const LoopMetrics &m) { return m.overflow_evictions.get(); },
+    };
+    perLoopReasons(out, loops, "chatsrv_evictions_total", "Clients dropped by the server.",
+                   evictions, eviction_reads, 3);
+
+    perLoop(out, loops, "chatsrv_throttle_pauses_total", "counter", "Readers paused over the outbound budget.",
+            [](const LoopMetrics &m) { return m.throttle_pauses.get(); });
+    perLoop(out, loops, "chatsrv_throttle_resumes_total", "counter", "Paused readers resumed.",
+            [](const LoopMetrics &m) { return m.throttle_resumes.get(); });
+
+    perLoop(out, loops, "chatsrv_read_yields_total", "counter", "Clients deferred at their read quota with input left.",
+            [](const LoopMetrics &m) { return m.read_yields.get(); });
+
+    const char *fairness = "chatsrv_read_fairness";
+    header(out, fairness, "gauge", "Jain's index of bytes read per sending client over the last second, "
+           "1 when all got the same, 1/n when one got all; poller loops only.");
+    for (size_t i = 0; i < loops.size(); ++i) {
+        char labels[32], value[32];
+        snprintf(labels, sizeof(labels), "loop=\"%zu\"", i);
+        snprintf(value, sizeof(value), "%.4f", loops[i]->read_fairness.get());
+        sample(out, fairness, labels, value);
+    }
+
+    histogram(out, loops, "chatsrv_loop_iteration_seconds", "Work per event loop wake-up, waiting excluded.",
+              &LoopMetrics::iteration);
+    histogram(out, loops, "chatsrv_fanout_seconds", "From a message read to queued for every member on the loop.",
+              &LoopMetrics::fanout);
+
+    header(out, "chatsrv_queued_bytes", "gauge", "Bytes queued to clients by all loops.");
+    integer(out, "chatsrv_queued_bytes", "", global.queued_bytes > 0 ? global.queued_bytes : 0);
+    header(out, "chatsrv_out_budget_bytes", "gauge", "Outbound backlog that pauses readers; 0 is off.");
+    integer(out, "chatsrv_out_budget_bytes", "", global.out_budget);
+    header(out, "chatsrv_rooms", "gauge", "Rooms with members or messages in flight, the lobby included.");
+    integer(out, "chatsrv_rooms", "", global.rooms);
+    header(out, "chatsrv_log_dropped_total", "counter", "Log records dropped with --log-full drop.");
+    integer(out, "chatsrv_log_dropped_total", "", global.log_dropped);
+    return out;
+}
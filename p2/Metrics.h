@@ -0,0 +1,100 @@
+#ifndef P2_METRICS_H
+#define P2_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// Monotonic nanoseconds; a vDSO call on Linux and Mac OS X.
+uint64_t monotonicNs();
+
+
+// Written by one thread only, read by any. The update is a relaxed load and
+// store, plain moves on x86 and ARM: no locked instruction, no fence.
+class Counter {
+    std::atomic<uint64_t> value;
+
+public:
+    Counter() : value(0) { }
+
+    void add(uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+
+// A value set by one thread, read by any.
+class Gauge {
+    std::atomic<double> value;
+
+public:
+    explicit Gauge(double initial = 0) : value(initial) { }
+
+    void set(double v) { value.store(v, std::memory_order_relaxed); }
+    double get() const { return value.load(std::memory_order_relaxed); }
+};
+
+
+// Durations in power-of-two buckets from 1 us to about 1 s, and a last one
+// for anything longer.
+class LatencyHistogram {
+public:
+    static const int buckets = 22;
+
+private:
+    Counter counts[buckets];
+    Counter sum_ns;
+
+public:
+    void record(uint64_t ns);
+
+    // Upper bound of bucket i in microseconds; the last one has none.
+    static uint64_t boundUs(int i) { return (uint64_t) 1 << i; }
+    uint64_t count(int i) const { return counts[i].get(); }
+    uint64_t sumNs() const { return sum_ns.get(); }
+};
+
+
+// Everything one event loop counts. The loop is the only writer, and every
+// loop has its own, in an allocation of its own, so nothing on the hot path
+// is shared with other threads; the admin thread only reads.
+struct LoopMetrics {
+    Counter accepts;
+    Counter closes;
+    Counter messages_in;
+    Counter bytes_in;
+    Counter messages_out;    // queued to a client, once per recipient
+    Counter bytes_out;       // written to sockets
+    Counter writes;          // send calls that wrote them
+    Counter idle_evictions;
+    Counter stall_evictions;
+    Counter overflow_evictions;  // backlog over the per-client limit
+    Counter throttle_pauses;
+    Counter throttle_resumes;
+    Counter read_yields;     // clients sent to the back of the line at their quota
+    Gauge read_fairness;     // Jain's index of bytes read per sender, last window
+
+    LoopMetrics() : read_fairness(1) { }
+
+    LatencyHistogram iteration;  // work done per wake-up, without the wait
+    LatencyHistogram fanout;     // message read to queued for every member
+};
+
+
+// Process-wide values that are not per loop.
+struct GlobalMetrics {
+    int64_t queued_bytes;
+    size_t out_budget;
+    size_t log_dropped;
+    size_t rooms;
+};
+
+
+// Prometheus text exposition format, version 0.0.4.
+std::string formatMetrics(const std::vector<std::unique_ptr<LoopMetrics>> &loops, const GlobalMetrics &global);
+
+#endif //P2_METRICS_H
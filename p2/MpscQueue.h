@@ -0,0 +1,60 @@
+#ifndef P2_MPSCQUEUE_H
+#define P2_MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+
+// Unbounded multi-producer single-consumer queue (Vyukov). push() is one
+// atomic exchange and never blocks or retries; pop() may only be called by
+// the owning thread. tail always points at a node whose value has already
+// been taken.
+template <class T>
+class MpscQueue {
+    struct Node {
+        std::atomic<Node *> next;
+        T value;
+
+        Node() : next(nullptr) { }
+        explicit Node(T &&v) : next(nullptr), value(std::move(v)) { }
+    };
+
+    std::atomic<Node *> head;  // last pushed, shared by producers
+    Node *tail;                // consumer only
+
+public:
+    MpscQueue() {
+        Node *stub = new Node();
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+
+    ~MpscQueue() {
+        T value;
+        while (pop(value));
+        delete tail;
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T value) {
+        Node *node = new Node(std::move(value));
+        Node *prev = head.exchange(node, std::memory_order_acq_rel);
+        // Between these two lines the consumer sees the queue as ending at
+        // prev; it picks node up on its next pop().
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    bool pop(T &value) {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (!next)
+            return false;
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+};
+
+#endif //P2_MPSCQUEUE_H
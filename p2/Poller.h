@@ -0,0 +1,43 @@
+#ifndef P2_POLLER_H
+#define P2_POLLER_H
+
+// Readiness notification behind one interface: epoll on Linux, kqueue on
+// Mac OS X / BSD. Poller::create() picks the backend of the platform.
+
+enum PollFlags {
+    PollIn = 1,     // readable, or the peer hung up
+    PollOut = 2,    // writable
+    PollEdge = 4,   // report a change of state once, not while it lasts
+    PollHup = 8,    // the peer hung up or the connection failed; reported
+                    // with PollIn, and where supported without it too
+};
+
+
+struct PollEvent {
+    int fd;
+    unsigned flags;  // PollIn | PollOut | PollHup
+};
+
+
+class Poller {
+public:
+    virtual ~Poller() { }
+
+    // Listening socket. When several pollers watch the same listener only
+    // one of them is woken per incoming connection, where supported.
+    virtual void addListener(int fd) = 0;
+
+    virtual void add(int fd, unsigned flags) = 0;
+    virtual void modify(int fd, unsigned flags) = 0;
+    virtual void remove(int fd) = 0;
+
+    // Fills up to max events, waiting at most timeout_ms (-1 for ever).
+    // Returns the number of events, 0 on timeout or signal.
+    virtual int wait(PollEvent *events, int max, int timeout_ms) = 0;
+
+    virtual const char *name() const = 0;
+
+    static Poller *create();
+};
+
+#endif //P2_POLLER_H
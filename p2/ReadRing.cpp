@@ -0,0 +1,97 @@
+#include <sys/uio.h>
+#include <algorithm>
+#include <cstring>
+#include "ReadRing.h"
+
+
+void ReadRing::reserve() {
+    if (!buf)
+        buf.reset((char *) BlockPool::get());
+}
+
+
+void ReadRing::releaseIfEmpty() {
+    if (size())
+        return;
+    buf.reset();
+    head = tail = scanned = 0;
+}
+
+
+ssize_t ReadRing::fill(int fd) {
+    reserve();
+
+    // Free space is at most two pieces: up to the end of the memory, then
+    // from its start up to head.
+    size_t free_bytes = capacity - size();
+    size_t first = std::min(free_bytes, capacity - (tail & (capacity - 1)));
+
+    struct iovec iov[2];
+    iov[0].iov_base = at(tail);
+    iov[0].iov_len = first;
+    iov[1].iov_base = buf.get();
+    iov[1].iov_len = free_bytes - first;
+
+    ssize_t n = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (n > 0)
+        tail += n;
+    else
+        releaseIfEmpty();  // nothing came, e.g. EAGAIN
+    return n;
+}
+
+
+size_t ReadRing::write(const char *data, size_t n) {
+    reserve();
+
+    n = std::min(n, capacity - size());
+    size_t first = std::min(n, capacity - (tail & (capacity - 1)));
+    memcpy(at(tail), data, first);
+    memcpy(buf.get(), data + first, n - first);
+    tail += n;
+    return n;
+}
+
+
+// The first length bytes as one Message, consuming them.
+Message ReadRing::take(size_t length, bool add_newline) {
+    size_t first = std::min(length, capacity - (head & (capacity - 1)));
+
+    struct iovec iov[3];
+    iov[0].iov_base = at(head);
+    iov[0].iov_len = first;
+    iov[1].iov_base = buf.get();
+    iov[1].iov_len = length - first;
+    iov[2].iov_base = (void *) "\n";
+    iov[2].iov_len = add_newline ? 1 : 0;
+
+    head += length;
+    scanned = 0;
+    return Message(iov, 3);
+}
+
+
+bool ReadRing::next(Message &msg) {
+    // Never look further than one message ahead.
+    size_t limit = head + std::min(size(), (size_t) MAX_MSG);
+
+    // memchr over at most two contiguous pieces; the bytes already
+    // scanned by an earlier call are skipped.
+    for (size_t pos = head + scanned; pos < limit;) {
+        size_t run = std::min(limit - pos, capacity - (pos & (capacity - 1)));
+        const char *found = (const char *) memchr(at(pos), '\n', run);
+        if (found) {
+            msg = take(pos + (found - at(pos)) + 1 - head, false);
+            return true;
+        }
+        pos += run;
+    }
+    scanned = limit - head;
+
+    if (size() >= MAX_MSG) {
+        msg = take(MAX_MSG - 1, true);
+        return true;
+    }
+    releaseIfEmpty();
+    return false;
+}
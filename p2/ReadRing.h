@@ -0,0 +1,47 @@
+#ifndef P2_READRING_H
+#define P2_READRING_H
+
+#include <cstddef>
+#include <memory>
+#include <sys/types.h>
+#include "BlockPool.h"
+#include "Message.h"
+
+#define MAX_MSG 1024
+
+
+// Per-client input buffer: a ring filled by large reads, cut into messages.
+// A message is everything up to and including a '\n', at most MAX_MSG
+// bytes. A longer line is sent in MAX_MSG pieces, each ended with '\n' so
+// that pieces of different senders cannot interleave within a line. The
+// ring memory is a pool block, taken by a read and given back whenever the
+// ring is empty again.
+class ReadRing {
+    std::unique_ptr<char, BlockPool::Deleter> buf;
+    size_t head;     // first unconsumed byte, grows without wrapping
+    size_t tail;     // one past the last byte read
+    size_t scanned;  // bytes after head known to hold no '\n'
+
+    static const size_t capacity = POOL_BLOCK;  // power of two, >= MAX_MSG
+
+    char *at(size_t pos) const { return buf.get() + (pos & (capacity - 1)); }
+    Message take(size_t length, bool add_newline);
+    void reserve();
+    void releaseIfEmpty();
+
+public:
+    ReadRing() : head(0), tail(0), scanned(0) { }
+
+    // One readv() into the free space. Returns its result.
+    ssize_t fill(int fd);
+
+    // Copies up to n bytes in, returns how many fitted.
+    size_t write(const char *data, size_t n);
+
+    // Extracts the next complete message, false if there is none yet.
+    bool next(Message &msg);
+
+    size_t size() const { return tail - head; }
+};
+
+#endif //P2_READRING_H
@@ -0,0 +1,78 @@
+#include <cstring>
+#include "Rooms.h"
+
+
+RoomDirectory::RoomDirectory(int _loops) : next_id(0), loops(_loops) {
+    lobby_room = find("");  // and never released
+}
+
+
+Room *RoomDirectory::find(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::unique_ptr<Room> &room = rooms[name];
+    if (!room) {
+        room.reset(new Room());
+        if (free_ids.empty()) {
+            room->id = next_id++;
+        } else {
+            room->id = free_ids.back();
+            free_ids.pop_back();
+        }
+        room->name = name;
+        room->members.reset(new std::atomic<size_t>[loops]());
+        room->refs.store(0, std::memory_order_relaxed);
+    }
+    hold(room.get(), 1);
+    return room.get();
+}
+
+
+void RoomDirectory::release(Room *room) {
+    // Without the lock while others are left.
+    size_t refs = room->refs.load(std::memory_order_relaxed);
+    while (refs > 1)
+        if (room->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_acq_rel))
+            return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (room->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;  // held again in between
+    // Every loop's member array for the id is empty by now.
+    free_ids.push_back(room->id);
+    rooms.erase(rooms.find(room->name));  // the key is the room's own
+}
+
+
+size_t RoomDirectory::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return rooms.size();
+}
+
+
+bool parseRoomCommand(const Message &msg, std::string &name) {
+    static const char join[] = "/join ";
+    static const char leave[] = "/leave";
+
+    // Without the '\n'; a '\r' before it is tolerated.
+    size_t size = msg.size();
+    if (!size || msg.data()[size - 1] != '\n')
+        return false;
+    size--;
+    if (size && msg.data()[size - 1] == '\r')
+        size--;
+
+    if (size == sizeof(leave) - 1 && !memcmp(msg.data(), leave, size)) {
+        name.clear();
+        return true;
+    }
+
+    if (size <= sizeof(join) - 1 || memcmp(msg.data(), join, sizeof(join) - 1))
+        return false;
+    const char *start = msg.data() + sizeof(join) - 1;
+    size_t length = size - (sizeof(join) - 1);
+    if (length > MAX_ROOM_NAME || memchr(start, ' ', length))
+        return false;
+    name.assign(start, length);
+    return true;
+}
@@ -0,0 +1,110 @@
+#ifndef P2_ROOMS_H
+#define P2_ROOMS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Message.h"
+
+#define MAX_ROOM_NAME 64
+
+
+// A named room. Every client is in exactly one; new clients start in the
+// lobby, the room named "". A room is freed with its last reference, and
+// its id goes to the next room made; the lobby keeps one of its own.
+struct Room {
+    uint32_t id;  // dense, the lobby is 0
+    std::string name;
+    std::unique_ptr<std::atomic<size_t>[]> members;  // count per loop
+    std::atomic<size_t> refs;  // a member's, or a message's posted to a loop
+};
+
+
+// Room names to rooms, shared by all loops. Joins and giving up the last
+// reference of a room take the lock; the count only leaves or reaches zero
+// under it, so find() never returns a room being freed.
+class RoomDirectory {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<Room>> rooms;
+    std::vector<uint32_t> free_ids;
+    uint32_t next_id;
+    int loops;
+    Room *lobby_room;
+
+public:
+    explicit RoomDirectory(int _loops);
+
+    RoomDirectory(const RoomDirectory &) = delete;
+    RoomDirectory &operator=(const RoomDirectory &) = delete;
+
+    // Creates the room on first use. Takes a reference for the caller.
+    Room *find(const std::string &name);
+    Room *lobby() {
+        hold(lobby_room, 1);
+        return lobby_room;
+    }
+
+    // More references to a room the caller holds one of.
+    static void hold(Room *room, size_t n) { room->refs.fetch_add(n, std::memory_order_relaxed); }
+    // Frees the room with its last reference.
+    void release(Room *room);
+
+    size_t size();
+};
+
+
+// Control lines: "/join NAME" moves the client to room NAME and "/leave"
+// back to the lobby. Returns true if msg is one, with the room name.
+// Anything else, even starting with '/', is an ordinary message.
+bool parseRoomCommand(const Message &msg, std::string &name);
+
+
+// The members of every room as seen by one loop, in one dense array per
+// room, so that a broadcast walks only its room and walks it in order.
+// Membership changes swap the last member into the gap; the caller keeps
+// each member's index up to date from the return values.
+template <class Member>
+class RoomMembers {
+    std::vector<std::vector<Member>> rooms;  // by room id
+
+public:
+    // Returns the index of the new member.
+    size_t add(Room *room, const Member &member, int loop) {
+        if (rooms.size() <= room->id)
+            rooms.resize(room->id + 1);
+        std::vector<Member> &list = rooms[room->id];
+        list.push_back(member);
+        room->members[loop].store(list.size(), std::memory_order_relaxed);
+        return list.size() - 1;
+    }
+
+    // Returns the member moved to index, or nullptr if none was.
+    Member *remove(Room *room, size_t index, int loop) {
+        std::vector<Member> &list = rooms[room->id];
+        bool moved = index + 1 < list.size();
+        if (moved)
+            list[index] = list.back();
+        list.pop_back();
+        room->members[loop].store(list.size(), std::memory_order_relaxed);
+
+        // Give back the array of a room that emptied, however big it was.
+        if (list.empty())
+            std::vector<Member>().swap(list);
+        return moved ? &list[index] : nullptr;
+    }
+
+    const Member *begin(const Room *room) const {
+        return room->id < rooms.size() ? rooms[room->id].data() : nullptr;
+    }
+
+    const Member *end(const Room *room) const {
+        return room->id < rooms.size() ? rooms[room->id].data() + rooms[room->id].size() : nullptr;
+    }
+};
+
+#endif //P2_ROOMS_H
@@ -1,17 +1,28 @@
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <system_error>
-#include <sys/fcntl.h>
-#include <sys/event.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
 #include <strings.h>
 #include <unistd.h>
+#include <thread>
 #include <vector>
 #include <string>
-#include <map>
+#include "Server.h"
+#include "Shard.h"
 
-// Mac OS X
+// Linux, Mac OS X
 
-#define MAX_BUF 5
+#define LOG_RING 16384  // log records in flight
+#define ADMIN_REQUEST 4096  // bytes of a scrape request read
+#define ADMIN_RETRY_MS 100  // pause after a failed accept, e.g. out of descriptors
 
 
 int set_nonblock(int fd) {
@@ -28,30 +39,35 @@ int set_nonblock(int fd) {
 }
 
 
-class Server {
-    int port;
-    int master_sock_fd;
-
-    const static char *welcome_msg;
-
-    void mainLoop();
-    void initMasterSock();
-public:
-    Server(int _port);
-    ~Server() { };
-    void run();
-};
+std::string peerName(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    char host[INET_ADDRSTRLEN];
+    if (getpeername(fd, (struct sockaddr *) &addr, &len) == -1 ||
+        !inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host)))
+        return "?";
+    return std::string(host) + ":" + std::to_string(ntohs(addr.sin_port));
+}
 
 
 const char *Server::welcome_msg = "Welcome\n";
 
 
 Server::Server(int _port)
-        : port(_port) { }
+        : port(_port), use_io_uring(false), threads(1),
+          log_policy(Logger::Block), log_thread(false),
+          idle_timeout(0), stall_timeout(10), out_budget(64 << 20), queued_out(0),
+          admin_port(0), next_seq(0),
+          welcome(welcome_msg, strlen(welcome_msg)) { }
 
 
-void Server::initMasterSock() {
-    master_sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+Server::~Server() { }
+
+
+// With reuse_port every shard binds a listener of its own to the port and
+// the kernel spreads incoming connections over them.
+int Server::openListener(bool reuse_port) {
+    int master_sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (master_sock_fd == -1)
         throw std::system_error(errno, std::system_category());
 
@@ -59,6 +75,8 @@ void Server::initMasterSock() {
 
     int optval = 1; // Reusable descriptor if we kill app
     setsockopt(master_sock_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (reuse_port && setsockopt(master_sock_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1)
+        throw std::system_error(errno, std::system_category());
 
 
     struct sockaddr_in SockAddr;
@@ -66,96 +84,217 @@ void Server::initMasterSock() {
     SockAddr.sin_port = htons(port);
     SockAddr.sin_addr.s_addr = INADDR_ANY;
 
-    int res = bind(master_sock_fd, (struct sockaddr *) &SockAddr, sizeof(SockAddr));
+    // A previous instance killed while running on io_uring keeps the port
+    // until the kernel has torn its ring down, a few milliseconds later.
+    int res;
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        res = bind(master_sock_fd, (struct sockaddr *) &SockAddr, sizeof(SockAddr));
+        if (res == 0 || errno != EADDRINUSE)
+            break;
+        usleep(10000);
+    }
     if (res == -1)
         throw std::system_error(errno, std::system_category());
 
     res = listen(master_sock_fd, SOMAXCONN);
     if (res == -1)
         throw std::system_error(errno, std::system_category());
+    return master_sock_fd;
 }
 
 
-void Server::mainLoop() {
-    int KQueue = kqueue();
-
-    struct kevent changeEvent;
-    struct kevent eventlist[100];
-
-    bzero(&changeEvent, sizeof(changeEvent));
-    EV_SET(&changeEvent, master_sock_fd, EVFILT_READ, EV_ADD, 0, 0, 0);
-    kevent(KQueue, &changeEvent, 1, NULL, 0, NULL);
-
-    std::map<int, std::string> clientsMap;
-
-    while (true) {
-        bzero(eventlist, 100 * sizeof(struct kevent));
-        int kN = kevent(KQueue, NULL, 0, eventlist, 100, NULL);
-
-        for (int i = 0; i < kN; ++i) {
-            if (eventlist[i].filter == EVFILT_READ) {
-                if (eventlist[i].ident == master_sock_fd) {
-                    int slave_sock_fd = accept(master_sock_fd, 0, 0);
-                    if (slave_sock_fd == -1)
-                        throw std::system_error(errno, std::system_category());
-                    set_nonblock(slave_sock_fd);
-
-                    bzero(&changeEvent, sizeof(changeEvent));
-                    EV_SET(&changeEvent, slave_sock_fd, EVFILT_READ, EV_ADD, 0, 0, 0);
-                    kevent(KQueue, &changeEvent, 1, NULL, 0, NULL);
-
-                    clientsMap[slave_sock_fd] = "";
+// Metrics go to loopback only, from a thread of their own: a scrape only
+// reads the loops' counters and never waits on them.
+int Server::openAdmin() {
+    int admin_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (admin_fd == -1)
+        throw std::system_error(errno, std::system_category());
 
+    int optval = 1;
+    setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
-                    send(slave_sock_fd, welcome_msg, strlen(welcome_msg), SO_NOSIGPIPE);
+    struct sockaddr_in SockAddr;
+    memset(&SockAddr, 0, sizeof(SockAddr));
+    SockAddr.sin_family = AF_INET;
+    SockAddr.sin_port = htons(admin_port);
+    SockAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-                    fprintf(stdout, "LOG: accepted connection\n");
-                    fflush(stdout);
+    if (bind(admin_fd, (struct sockaddr *) &SockAddr, sizeof(SockAddr)) == -1 || listen(admin_fd, 16) == -1)
+        throw std::system_error(errno, std::system_category());
+    return admin_fd;
+}
 
-                } else {
-                    char buffer[MAX_BUF];
-                    int n = (int) read(eventlist[i].ident, buffer, MAX_BUF);
-                    buffer[n] = '\0';
 
-                    if (n <= 0) {
-                        fprintf(stdout, "LOG: connection terminated\n");
-                        fflush(stdout);
+// One blocking request at a time: whatever is asked, the answer is the
+// metrics, as HTTP/1.0 so that the connection simply ends with them.
+void Server::serveAdmin(int admin_fd) {
+    bool failing = false;  // logged once per run of failures
+    while (true) {
+        int fd = accept(admin_fd, 0, 0);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // EMFILE and the like would fail again at once.
+            if (!failing) {
+                char line[96];
+                snprintf(line, sizeof(line), "LOG: admin accept failed: %s, retrying\n", strerror(errno));
+                logger->note(line);
+                failing = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(ADMIN_RETRY_MS));
+            continue;
+        }
+        failing = false;
+
+        struct timeval timeout = {1, 0};  // a silent scraper does not hold us up
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        int optval = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
+#endif
 
-                        close((int) eventlist[i].ident);
-                        clientsMap.erase((int) eventlist[i].ident);
-                    } else {
-                        std::string msg = clientsMap[eventlist[i].ident].append(buffer);
+        // Up to the end of the headers.
+        char request[ADMIN_REQUEST];
+        size_t got = 0;
+        while (got < sizeof(request) - 1) {
+            ssize_t n = recv(fd, request + got, sizeof(request) - 1 - got, 0);
+            if (n <= 0)
+                break;
+            got += n;
+            request[got] = 0;
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+                break;
+        }
 
-                        if (msg[msg.size() - 1] == '\n') {
-                            fprintf(stdout, "LOG MSG: %s", msg.c_str());
-                            fflush(stdout);
+        GlobalMetrics global;
+        global.queued_bytes = queued_out.load(std::memory_order_relaxed);
+        global.out_budget = out_budget;
+        global.log_dropped = logger->dropped();
+        global.rooms = rooms->size();
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n" +
+                               formatMetrics(metrics, global);
+
+        for (size_t sent = 0; sent < response.size();) {
+#ifdef MSG_NOSIGNAL
+            ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+#else
+            ssize_t n = send(fd, response.data() + sent, response.size() - sent, 0);
+#endif
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+        close(fd);
+    }
+}
 
-                            for (auto &kv : clientsMap)
-                                send(kv.first, msg.c_str(), msg.size(), SO_NOSIGPIPE);
 
-                            clientsMap[eventlist[i].ident] = "";
-                        }
-                    }
+void Server::broadcast(const Message &msg, Room *room, Shard *from) {
+    uint64_t read_at = monotonicNs();
+    if (shards.size() == 1) {
+        from->deliver(room, msg, read_at);
+        return;
+    }
 
-                }
+    // Every shard gives its reference back once it has delivered.
+    RoomDirectory::hold(room, shards.size());
+    uint64_t seq = next_seq.fetch_add(1);
+    for (auto &shard : shards)
+        shard->post(seq, room, msg, read_at, shard.get() != from);
+}
 
 
-            }
+void Server::run() {
+    // A descriptor per connection: 100k clients need more than the usual
+    // soft limit of 1024. Best effort.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
-        }
+    int log_fd = STDOUT_FILENO;
+    if (!log_file.empty()) {
+        log_fd = open(log_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd == -1)
+            throw std::system_error(errno, std::system_category());
     }
-}
+    logger.reset(new Logger(log_fd, LOG_RING, log_policy));
+    if (log_thread)
+        logger->startWriter();
+    rooms.reset(new RoomDirectory(use_io_uring ? 1 : threads));
+    for (int i = 0; i < (use_io_uring ? 1 : threads); ++i)
+        metrics.push_back(std::unique_ptr<LoopMetrics>(new LoopMetrics()));
+
+    // Runs as long as the loops do, which is until the process exits.
+    if (admin_port)
+        std::thread(&Server::serveAdmin, this, openAdmin()).detach();
+
+#ifdef __linux__
+    if (use_io_uring) {
+        int master_sock_fd = openListener(false);
+        uringLoop(master_sock_fd);  // returns only without io_uring
+        shards.push_back(std::unique_ptr<Shard>(new Shard(*this, *logger, 0, master_sock_fd, welcome)));
+        shards[0]->run();
+    }
+#endif
 
+    for (int i = 0; i < threads; ++i)
+        shards.push_back(std::unique_ptr<Shard>(new Shard(*this, *logger, i, openListener(threads > 1), welcome)));
 
-void Server::run() {
-    initMasterSock();
-    mainLoop();
+    // Shard 0 runs on the main thread.
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i)
+        workers.push_back(std::thread(&Shard::run, shards[i].get()));
+    shards[0]->run();
 }
 
 
-int main() {
-    Server s = Server(3100);
+int main(int argc, char **argv) {
+    Server s(3100);
+    std::string log_file;
+    Logger::Policy log_policy = Logger::Block;
+    bool log_thread = false;
+    int idle_timeout = 0;
+    int stall_timeout = 10;
+    int out_budget = 64;
+    int admin_port = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--io-uring")) {
+            s.useIoUring(true);
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            s.setThreads(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--log-file") && i + 1 < argc) {
+            log_file = argv[++i];
+        } else if (!strcmp(argv[i], "--log-full") && i + 1 < argc && !strcmp(argv[i + 1], "drop")) {
+            log_policy = Logger::Drop;
+            i++;
+        } else if (!strcmp(argv[i], "--log-full") && i + 1 < argc && !strcmp(argv[i + 1], "block")) {
+            log_policy = Logger::Block;
+            i++;
+        } else if (!strcmp(argv[i], "--log-thread")) {
+            log_thread = true;
+        } else if (!strcmp(argv[i], "--idle-timeout") && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            idle_timeout = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--stall-timeout") && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            stall_timeout = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--out-budget") && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            out_budget = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--admin-port") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            admin_port = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--io-uring | --threads N] [--log-file PATH] "
+                    "[--log-full drop|block] [--log-thread] [--idle-timeout SEC] "
+                    "[--stall-timeout SEC] [--out-budget MB] [--admin-port N]\n", argv[0]);
+            return 1;
+        }
+    }
+    s.setLog(log_file, log_policy, log_thread);
+    s.setTimeouts(idle_timeout, stall_timeout);
+    s.setOutBudget((size_t) out_budget << 20);
+    s.setAdminPort(admin_port);
     s.run();
     return 0;
 }
-
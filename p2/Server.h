@@ -0,0 +1,111 @@
+#ifndef P2_SERVER_H
+#define P2_SERVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Logger.h"
+#include "Message.h"
+#include "Metrics.h"
+#include "Rooms.h"
+
+class Shard;
+
+// Limits both loops, the poller shards and io_uring, enforce.
+#define MAX_OUTBOUND (1024 * 1024)  // queued bytes before a client is dropped
+#define STALL_MARK (MAX_OUTBOUND / 4)  // queued bytes that start the stall timer
+#define TICK_MS 10                  // timer resolution
+#define RATE_WINDOW (1000 / TICK_MS)  // ticks between halvings of recent_in
+
+
+int set_nonblock(int fd);
+
+// "address:port" of a connected socket, for the log.
+std::string peerName(int fd);
+
+
+// Tick of a monotonicNs() time.
+inline uint64_t tickOf(uint64_t ns) {
+    return ns / (1000000ull * TICK_MS);
+}
+
+
+// Owns the shards and numbers the messages they broadcast. By default one
+// shard runs on the main thread, as the task requires; --threads N runs N
+// of them, one per thread, each with its own SO_REUSEPORT listener.
+class Server {
+    int port;
+    bool use_io_uring;
+    int threads;
+
+    std::string log_file;  // stdout if empty
+    Logger::Policy log_policy;
+    bool log_thread;
+    std::unique_ptr<Logger> logger;
+
+    int idle_timeout;   // seconds; 0 is off
+    int stall_timeout;
+
+    size_t out_budget;                 // bytes queued to clients; 0 is off
+    std::atomic<int64_t> queued_out;   // by all shards
+
+    int admin_port;  // metrics over HTTP on loopback; 0 is off
+    std::vector<std::unique_ptr<LoopMetrics>> metrics;  // one per loop
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<uint64_t> next_seq;
+    std::unique_ptr<RoomDirectory> rooms;
+
+    const static char *welcome_msg;
+    Message welcome;
+
+    int openListener(bool reuse_port);
+    int openAdmin();
+    void serveAdmin(int admin_fd);
+
+#ifdef __linux__
+    // Completion-based loop on io_uring (UringServer.cpp). Returns, having
+    // logged why, only if io_uring is unavailable; errors once it is serving
+    // are thrown.
+    void uringLoop(int master_sock_fd);
+#endif
+public:
+    Server(int _port);
+    ~Server();
+    void useIoUring(bool on) { use_io_uring = on; }
+    void setThreads(int n) { threads = n; }
+    void setLog(const std::string &file, Logger::Policy policy, bool thread) {
+        log_file = file;
+        log_policy = policy;
+        log_thread = thread;
+    }
+    void setTimeouts(int idle, int stall) {
+        idle_timeout = idle;
+        stall_timeout = stall;
+    }
+    int idleTimeout() const { return idle_timeout; }
+    int stallTimeout() const { return stall_timeout; }
+    void setOutBudget(size_t bytes) { out_budget = bytes; }
+
+    // Total outbound backlog against the budget.
+    size_t outBudget() const { return out_budget; }
+    int64_t addQueued(int64_t delta) { return queued_out.fetch_add(delta) + delta; }
+
+    void setAdminPort(int port) { admin_port = port; }
+    LoopMetrics &loopMetrics(int loop) { return *metrics[loop]; }
+
+    // Both take a reference to the room, given back with releaseRoom().
+    Room *room(const std::string &name) { return rooms->find(name); }
+    Room *lobby() { return rooms->lobby(); }
+    void releaseRoom(Room *room) { rooms->release(room); }
+
+    // Called by a shard for every message it has read. All members of the
+    // room, on all shards, receive the messages in the same order.
+    void broadcast(const Message &msg, Room *room, Shard *from);
+
+    void run();
+};
+
+#endif //P2_SERVER_H
@@ -0,0 +1,620 @@
+#include <sys/socket.h>
+#include <system_error>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "Server.h"
+#include "Shard.h"
+
+// Linux, Mac OS X
+
+#define MAX_EVENTS 256
+#define MAX_IOV 64                  // queued messages per sendmsg()
+#define FLUSH_BYTES (64 * 1024)     // queued bytes written without waiting for the iteration's end
+#define FLUSH_DELAY 1000000         // ns a queued message may wait for the iteration's end
+#define READ_QUOTA (16 * 1024)      // bytes read from a client before the others get a turn
+
+// Linux has no SO_NOSIGPIPE, only a per-call flag.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// Linux: more follows right away, do not push a short last segment yet.
+#ifdef MSG_MORE
+#define MORE_FLAGS MSG_MORE
+#else
+#define MORE_FLAGS 0
+#endif
+
+
+static uint64_t currentTick() {
+    return tickOf(monotonicNs());
+}
+
+
+Shard::Shard(Server &_server, Logger &_logger, int _index, int _listen_fd, const Message &_welcome)
+        : server(_server), logger(_logger), metrics(_server.loopMetrics(_index)), index(_index), listen_fd(_listen_fd), accept_retry(0), accept_failures(0), welcome(_welcome),
+          poller(Poller::create()), dirty_since(0), wheel(currentTick()), now(currentTick()),
+          idle_ticks((uint64_t) _server.idleTimeout() * 1000 / TICK_MS),
+          stall_ticks((uint64_t) _server.stallTimeout() * 1000 / TICK_MS),
+          queued_delta(0), window_start(now), paused_count(0),
+          next_seq(0), wake_pending(false) {
+#ifdef __linux__
+    wake_fds[0] = wake_fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fds[0] == -1)
+        throw std::system_error(errno, std::system_category());
+#else
+    if (pipe(wake_fds) == -1)
+        throw std::system_error(errno, std::system_category());
+    set_nonblock(wake_fds[0]);
+    set_nonblock(wake_fds[1]);
+#endif
+
+    poller->addListener(listen_fd);
+    poller->add(wake_fds[0], PollIn);
+}
+
+
+Shard::~Shard() {
+    close(wake_fds[0]);
+    if (wake_fds[1] != wake_fds[0])
+        close(wake_fds[1]);
+}
+
+
+void Shard::run() {
+    PollEvent eventlist[MAX_EVENTS];
+
+    while (true) {
+        // Sleep until the next timer is due; forever if there is none.
+        int64_t idle = wheel.idleTicks(now);
+        int timeout = idle < 0 ? -1 : idle > INT_MAX / TICK_MS ? INT_MAX : (int) idle * TICK_MS;
+        // Paused readers wait on other shards' queues too, which do not
+        // wake this one as they drain.
+        if (paused_count && (timeout < 0 || timeout > TICK_MS))
+            timeout = TICK_MS;
+        if (accept_retry && (timeout < 0 || timeout > TICK_MS))
+            timeout = TICK_MS;
+        // Input left over: only look for new events.
+        if (!ready.empty())
+            timeout = 0;
+
+        int n = poller->wait(eventlist, MAX_EVENTS, timeout);
+        uint64_t woke = monotonicNs();
+        now = tickOf(woke);
+        if (accept_retry && now >= accept_retry) {
+            poller->addListener(listen_fd);
+            accept_retry = 0;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = eventlist[i].fd;
+            if (fd == listen_fd) {
+                acceptClients();
+                continue;
+            }
+            if (fd == wake_fds[0]) {
+                uint64_t count;
+                while (read(wake_fds[0], &count, sizeof(count)) > 0);
+                wake_pending.store(false);
+                continue;
+            }
+
+            // Closed earlier in this batch.
+            ClientState *client = clients.find(fd);
+            if (!client)
+                continue;
+
+            // A paused client is not read, so its hang-up would not be seen
+            // until the pause is over, holding its descriptor and queue. It
+            // is read to the end instead: as quick, and what it sent before
+            // hanging up still goes out.
+            if (eventlist[i].flags & PollHup)
+                client->hung_up = true;
+            if (client->hung_up && client->paused) {
+                client->paused = false;
+                paused_count--;
+                setInterest(fd, *client);
+                metrics.throttle_resumes.add(1);
+            }
+            if ((eventlist[i].flags & PollOut) && !flushClient(fd, *client))
+                doomed.push_back(fd);
+            closeDoomed();
+
+            // A client already waiting for its turn keeps its place.
+            client = clients.find(fd);
+            if (client && !client->ready && ((eventlist[i].flags & PollIn) || client->hung_up))
+                readClient(fd);
+            flushIfLate();
+        }
+        readReady();
+
+        // Messages from other shards, and this shard's own when there are
+        // several: they all go out in sequence order.
+        drainInbox();
+        flushDirty();
+        expireTimers();
+        applyBudget();
+        logger.commit();
+        metrics.iteration.record(monotonicNs() - woke);
+    }
+}
+
+
+// Takes every pending connection; the listener is level-triggered, so
+// anything left over shows up on the next wait.
+void Shard::acceptClients() {
+    while (true) {
+        int slave_sock_fd = accept(listen_fd, 0, 0);
+        if (slave_sock_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+                return;
+            // Out of descriptors or memory: the connection waits in the
+            // backlog. The listener is level-triggered and would report it
+            // again at once, so it is left alone until the next tick.
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                if (!accept_failures++) {
+                    char line[96];
+                    snprintf(line, sizeof(line), "LOG: accept failed: %s, retrying\n", strerror(errno));
+                    logger.note(line);
+                }
+                poller->remove(listen_fd);
+                accept_retry = now + 1;
+                return;
+            }
+            throw std::system_error(errno, std::system_category());
+        }
+        set_nonblock(slave_sock_fd);
+        if (accept_failures) {
+            char line[96];
+            snprintf(line, sizeof(line), "LOG: accepting again after %llu retries\n",
+                     (unsigned long long) accept_failures);
+            logger.note(line);
+            accept_failures = 0;
+        }
+#ifdef SO_NOSIGPIPE
+        int optval = 1;
+        setsockopt(slave_sock_fd, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
+#endif
+
+        poller->add(slave_sock_fd, PollIn | PollEdge);
+        ClientState &client = clients.insert(slave_sock_fd);
+        joinRoom(slave_sock_fd, client, server.lobby());
+        client.last_active = now;
+        client.idle_timer.data = client.stall_timer.data = slave_sock_fd;
+        if (idle_ticks)
+            wheel.schedule(&client.idle_timer, now + idle_ticks);
+
+        logger.log(Logger::Accepted);
+        metrics.accepts.add(1);
+
+        queueMessage(slave_sock_fd, client, welcome);
+        closeDoomed();
+    }
+}
+
+
+// Sends as much of the client's queue as the socket takes, and keeps write
+// readiness registered exactly while something is left. Returns false if
+// the connection is broken.
+bool Shard::flushClient(int fd, ClientState &client) {
+    while (!client.out.empty()) {
+        // One gathering write over the head of the queue. sendmsg() rather
+        // than writev() for the flags: Linux has no SO_NOSIGPIPE.
+        struct iovec iov[MAX_IOV];
+        int count = 0;
+        for (; count < MAX_IOV && (size_t) count < client.out.size(); ++count) {
+            const Message &msg = client.out.at(count);
+            size_t skip = count ? 0 : client.out_offset;
+            iov[count].iov_base = (void *) (msg.data() + skip);
+            iov[count].iov_len = msg.size() - skip;
+        }
+
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = count;
+
+        // Only a backlog longer than MAX_IOV takes several writes.
+        bool more = (size_t) count < client.out.size();
+        ssize_t n = sendmsg(fd, &hdr, SEND_FLAGS | (more ? MORE_FLAGS : 0));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return false;
+        }
+
+        // Drop what went out; the last message sent may be partial.
+        metrics.bytes_out.add(n);
+        metrics.writes.add(1);
+        client.out_bytes -= n;
+        queued_delta -= n;
+        while (n > 0) {
+            size_t left = client.out.front().size() - client.out_offset;
+            if ((size_t) n < left) {
+                client.out_offset += n;
+                break;
+            }
+            n -= left;
+            client.out.pop_front();
+            client.out_offset = 0;
+        }
+    }
+
+    checkStall(client);
+
+    bool want_write = !client.out.empty();
+    if (want_write != client.want_write) {
+        client.want_write = want_write;
+        setInterest(fd, client);
+    }
+    return true;
+}
+
+
+void Shard::setInterest(int fd, ClientState &client) {
+    unsigned flags = PollEdge;
+    if (!client.paused)
+        flags |= PollIn;
+    if (client.want_write)
+        flags |= PollOut;
+    poller->modify(fd, flags);
+}
+
+
+// Queues msg for fd, to be written together with whatever else the client
+// gets in this loop iteration. A client whose backlog would pass
+// MAX_OUTBOUND is not keeping up and is dropped, as is one whose
+// connection is broken. Dropping is deferred to closeDoomed(), so this is
+// safe to call while iterating clients or a room.
+void Shard::queueMessage(int fd, ClientState &client, const Message &msg) {
+    if (client.out_bytes + msg.size() > MAX_OUTBOUND) {
+        metrics.overflow_evictions.add(1);
+        doomed.push_back(fd);
+        return;
+    }
+
+    metrics.messages_out.add(1);
+    client.out.push_back(msg);
+    client.out_bytes += msg.size();
+    queued_delta += msg.size();
+
+    // Already waiting for the socket to drain: the message goes out then.
+    if (client.want_write) {
+        checkStall(client);
+        return;
+    }
+    // Enough for full segments: no point in waiting.
+    if (client.out_bytes >= FLUSH_BYTES) {
+        if (!flushClient(fd, client))
+            doomed.push_back(fd);
+        return;
+    }
+    if (!client.dirty) {
+        if (dirty.empty())
+            dirty_since = monotonicNs();
+        client.dirty = true;
+        dirty.push_back(fd);
+    }
+}
+
+
+// Writes what every client got queued since its last write.
+void Shard::flushDirty() {
+    for (int fd : dirty) {
+        ClientState *client = clients.find(fd);
+        if (!client || !client->dirty)
+            continue;  // closed, or a newcomer on a reused descriptor listed twice
+        client->dirty = false;
+        if (!client->want_write && !flushClient(fd, *client))
+            doomed.push_back(fd);
+    }
+    dirty.clear();
+    closeDoomed();
+}
+
+
+// Bounds the wait for the end of a long loop iteration.
+void Shard::flushIfLate() {
+    if (!dirty.empty() && monotonicNs() - dirty_since >= FLUSH_DELAY)
+        flushDirty();
+}
+
+
+// The stall timer runs while the backlog is over STALL_MARK, so that a
+// client has to stay behind for stall_ticks in a row to be dropped.
+void Shard::checkStall(ClientState &client) {
+    if (!stall_ticks)
+        return;
+    bool stalled = client.out_bytes > STALL_MARK;
+    if (stalled && !client.stall_timer.pending())
+        wheel.schedule(&client.stall_timer, now + stall_ticks);
+    else if (!stalled && client.stall_timer.pending())
+        wheel.cancel(&client.stall_timer);
+}
+
+
+// Reads only note the time; an idle timer that fires for a client active
+// since is pushed back then, so keeping it current costs nothing per read.
+void Shard::expireTimers() {
+    expired.clear();
+    wheel.advance(now, expired);
+
+    for (Timer *timer : expired) {
+        int fd = (int) timer->data;
+        ClientState &client = *clients.find(fd);  // closing cancels both
+
+        if (timer == &client.idle_timer) {
+            if (client.last_active + idle_ticks > now) {
+                wheel.schedule(timer, client.last_active + idle_ticks);
+                continue;
+            }
+            logger.note("LOG: idle connection timed out\n");
+            metrics.idle_evictions.add(1);
+        } else {
+            logger.note("LOG: stalled connection dropped\n");
+            metrics.stall_evictions.add(1);
+        }
+        doomed.push_back(fd);
+    }
+    closeDoomed();
+}
+
+
+void Shard::closeDoomed() {
+    for (int fd : doomed)
+        if (clients.find(fd))
+            closeClient(fd);
+    doomed.clear();
+}
+
+
+void Shard::closeClient(int fd) {
+    logger.log(Logger::Terminated);
+    metrics.closes.add(1);
+
+    ClientState &client = *clients.find(fd);
+    wheel.cancel(&client.idle_timer);
+    wheel.cancel(&client.stall_timer);
+    queued_delta -= client.out_bytes;
+    if (client.paused)
+        paused_count--;
+    leaveRoom(client);
+
+    poller->remove(fd);
+    close(fd);
+    clients.erase(fd);
+}
+
+
+void Shard::joinRoom(int fd, ClientState &client, Room *room) {
+    if (client.room)
+        leaveRoom(client);
+    client.room = room;
+    client.room_index = rooms.add(room, RoomMember{fd, &client}, index);
+}
+
+
+void Shard::leaveRoom(ClientState &client) {
+    RoomMember *moved = rooms.remove(client.room, client.room_index, index);
+    if (moved)
+        moved->client->room_index = client.room_index;
+    server.releaseRoom(client.room);
+    client.room = nullptr;
+}
+
+
+// Edge-triggered: read until the socket is drained or READ_QUOTA is used
+// up, broadcasting every complete message as soon as it is in. A client
+// stopped by its quota goes to the back of the ready list.
+void Shard::readClient(int fd) {
+    ClientState *client = clients.find(fd);
+    size_t quota = READ_QUOTA;
+    while (true) {
+        if (client->paused)
+            return;  // the rest waits for resumeProducers()
+        if (!quota) {
+            if (!client->ready) {
+                client->ready = true;
+                ready.push_back(fd);
+            }
+            metrics.read_yields.add(1);
+            return;
+        }
+
+        ssize_t n = client->in.fill(fd);
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            closeClient(fd);
+            return;
+        }
+        client->last_active = now;
+        client->recent_in += n;
+        quota -= (size_t) n < quota ? n : quota;
+        metrics.bytes_in.add(n);
+
+        Message msg;
+        std::string room_name;
+        while (client->in.next(msg)) {
+            logger.log(Logger::Received, msg);
+            metrics.messages_in.add(1);
+
+            if (parseRoomCommand(msg, room_name)) {
+                joinRoom(fd, *client, server.room(room_name));
+                continue;
+            }
+
+            server.broadcast(msg, client->room, this);
+            if (!clients.find(fd))  // the sender itself fell behind
+                return;
+        }
+
+        // A flood can take many reads to drain; do not wait for the end of
+        // the loop iteration to stop it, or to send what it brought.
+        applyBudget();
+        flushIfLate();
+        if (!clients.find(fd))
+            return;
+    }
+}
+
+
+// One turn for every client on the ready list, in the order they got
+// there; those that use up their quota again go to the back.
+void Shard::readReady() {
+    ready_turn.swap(ready);
+    for (int fd : ready_turn) {
+        ClientState *client = clients.find(fd);
+        if (!client || !client->ready)
+            continue;  // closed, or a newcomer on a reused descriptor listed twice
+        client->ready = false;
+        readClient(fd);
+        flushIfLate();
+    }
+    ready_turn.clear();
+}
+
+
+void Shard::deliver(Room *room, const Message &msg, uint64_t read_at) {
+    for (const RoomMember *member = rooms.begin(room); member != rooms.end(room); ++member)
+        queueMessage(member->fd, *member->client, msg);
+    closeDoomed();
+    metrics.fanout.record(monotonicNs() - read_at);
+}
+
+
+void Shard::post(uint64_t seq, Room *room, const Message &msg, uint64_t read_at, bool wake) {
+    int64_t charged = msg.size() * room->members[index].load(std::memory_order_relaxed);
+    server.addQueued(charged);
+    inbox.push(Posted{seq, room, msg, read_at, charged});
+    // One wake-up per batch: the flag stays set until the loop has woken.
+    if (wake && !wake_pending.exchange(true)) {
+        uint64_t one = 1;
+        if (write(wake_fds[1], &one, sizeof(one)) == -1 && errno != EAGAIN)
+            throw std::system_error(errno, std::system_category());
+    }
+}
+
+
+// Numbers are handed out before the messages are posted, so a shard can
+// see n + 1 before n; it holds n + 1 back until n has arrived.
+void Shard::drainInbox() {
+    Posted posted;
+    while (inbox.pop(posted)) {
+        if (posted.seq != next_seq) {
+            reorder[posted.seq] = std::move(posted);
+            continue;
+        }
+        deliver(posted.room, posted.msg, posted.read_at);
+        server.releaseRoom(posted.room);
+        queued_delta -= posted.charged;
+        next_seq++;
+
+        for (auto it = reorder.begin(); it != reorder.end() && it->first == next_seq; it = reorder.erase(it)) {
+            deliver(it->second.room, it->second.msg, it->second.read_at);
+            server.releaseRoom(it->second.room);
+            queued_delta -= it->second.charged;
+            next_seq++;
+        }
+    }
+}
+
+
+// Publishes this shard's change of backlog; called once per loop
+// iteration and after every read. Over the budget, the heaviest
+// senders of this shard stop being read, so that they stop multiplying
+// into every queue; once the total has drained to half the budget they are
+// read again. Each shard judges only its own clients.
+void Shard::applyBudget() {
+    int64_t queued = server.addQueued(queued_delta);
+    queued_delta = 0;
+
+    bool new_window = now - window_start >= RATE_WINDOW;
+    if (new_window) {
+        double sum = 0, squares = 0;
+        size_t senders = 0;
+        clients.forEach([&](int, ClientState &client) {
+            if (client.recent_in) {
+                sum += client.recent_in;
+                squares += (double) client.recent_in * client.recent_in;
+                senders++;
+            }
+            client.recent_in /= 2;
+        });
+        metrics.read_fairness.set(senders ? sum * sum / (senders * squares) : 1);
+        window_start = now;
+    }
+
+    int64_t budget = server.outBudget();
+    if (!budget)
+        return;
+    if (queued > budget && (!paused_count || new_window))
+        pauseProducers(queued);
+    else if (queued <= budget / 2 && paused_count)
+        resumeProducers(queued);
+}
+
+
+// Pauses every client that has sent at least half as much recently as the
+// top sender still being read.
+void Shard::pauseProducers(int64_t queued) {
+    size_t top = 0;
+    clients.forEach([&](int, ClientState &client) {
+        if (!client.paused && client.recent_in > top)
+            top = client.recent_in;
+    });
+    if (!top)
+        return;
+
+    clients.forEach([&](int fd, ClientState &client) {
+        // What a client that hung up has left is in its socket buffer:
+        // read it to the end rather than hold the connection.
+        if (client.paused || client.hung_up || client.recent_in < (top + 1) / 2)
+            return;
+
+        client.paused = true;
+        client.paused_at = now;
+        paused_count++;
+        setInterest(fd, client);
+        metrics.throttle_pauses.add(1);
+
+        char line[160];
+        snprintf(line, sizeof(line), "LOG: throttling %s: %zu bytes in recently, %lld bytes queued\n",
+                 peerName(fd).c_str(), client.recent_in, (long long) queued);
+        logger.note(line);
+    });
+}
+
+
+void Shard::resumeProducers(int64_t queued) {
+    clients.forEach([&](int fd, ClientState &client) {
+        if (!client.paused)
+            return;
+
+        client.paused = false;
+        paused_count--;
+        setInterest(fd, client);
+        metrics.throttle_resumes.add(1);
+
+        char line[160];
+        snprintf(line, sizeof(line), "LOG: resumed %s after %llu ms, %lld bytes queued\n",
+                 peerName(fd).c_str(), (unsigned long long) (now - client.paused_at) * TICK_MS,
+                 (long long) queued);
+        logger.note(line);
+    });
+}
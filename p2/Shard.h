@@ -0,0 +1,151 @@
+#ifndef P2_SHARD_H
+#define P2_SHARD_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+#include "FdTable.h"
+#include "Logger.h"
+#include "Message.h"
+#include "MessageQueue.h"
+#include "Metrics.h"
+#include "MpscQueue.h"
+#include "Poller.h"
+#include "ReadRing.h"
+#include "Rooms.h"
+#include "TimerWheel.h"
+
+class Server;
+
+
+// Per-connection state of the poller loop.
+struct ClientState {
+    ReadRing in;                  // received bytes not yet broadcast
+    MessageQueue out;             // messages to send, front() partly sent
+    size_t out_offset;            // bytes of out.front() already sent
+    size_t out_bytes;             // unsent bytes in out
+    bool want_write;              // registered for write readiness
+    bool dirty;                   // queued to since the last write, on the dirty list
+    bool ready;                   // stopped at its read quota, on the ready list
+
+    uint64_t last_active;         // tick of the last read
+    Timer idle_timer;             // re-armed lazily from last_active
+    Timer stall_timer;            // armed while out_bytes is over the mark
+
+    size_t recent_in;             // bytes read, halved every rate window
+    bool paused;                  // not read from while over the budget
+    bool hung_up;                 // PollHup seen: read to the end, never paused
+    uint64_t paused_at;           // tick
+
+    Room *room;
+    size_t room_index;            // in the shard's member array of room
+
+    ClientState() : out_offset(0), out_bytes(0), want_write(false), dirty(false), ready(false), last_active(0),
+                    recent_in(0), paused(false), hung_up(false), paused_at(0), room(nullptr), room_index(0) { }
+};
+
+
+// One readiness event loop with its own listener and clients. With several
+// shards every one runs on its own thread; messages read by any shard are
+// numbered by the Server and reach every shard through its inbox, where
+// they are put back in sequence order before being queued to clients.
+class Shard {
+    struct Posted {
+        uint64_t seq;
+        Room *room;
+        Message msg;
+        uint64_t read_at;  // monotonicNs(), for the fan-out latency
+        int64_t charged;   // bytes counted against the budget by post()
+    };
+
+    Server &server;
+    Logger &logger;
+    LoopMetrics &metrics;
+    int index;  // among the shards
+    int listen_fd;
+    uint64_t accept_retry;  // tick to watch the listener again; 0 while watched
+    uint64_t accept_failures;  // in a row, logged at the first and the last
+    const Message &welcome;
+
+    std::unique_ptr<Poller> poller;
+    FdTable<ClientState> clients;
+    std::vector<int> doomed;  // to close once the current broadcast is over
+
+    // Clients that used up their read quota with input possibly left. The
+    // edge has been consumed, so the loop comes back to them itself, a
+    // quota at a time in turn, between waits for new events.
+    std::vector<int> ready;
+    std::vector<int> ready_turn;  // the ones being served
+
+    // Messages are written at the end of the loop iteration, all of a
+    // client's in one sendmsg(), or earlier once the oldest has waited for
+    // FLUSH_DELAY.
+    std::vector<int> dirty;
+    uint64_t dirty_since;  // monotonicNs() of the first message waiting
+
+    struct RoomMember {
+        int fd;
+        ClientState *client;  // table entries do not move
+    };
+    RoomMembers<RoomMember> rooms;
+
+    // Idle and write-stall timeouts, in ticks; 0 is off. Timers live in the
+    // ClientState, whose address the table keeps stable.
+    TimerWheel wheel;
+    uint64_t now;  // tick, read once per loop iteration
+    uint64_t idle_ticks;
+    uint64_t stall_ticks;
+    std::vector<Timer *> expired;
+
+    // Server-wide outbound budget: this shard's share of the backlog is
+    // published once per loop iteration.
+    int64_t queued_delta;   // change not published yet
+    uint64_t window_start;  // tick the current rate window began
+    size_t paused_count;
+
+    // Cross-shard delivery.
+    MpscQueue<Posted> inbox;
+    std::map<uint64_t, Posted> reorder;   // arrived ahead of next_seq
+    uint64_t next_seq;
+    int wake_fds[2];                  // eventfd twice on Linux, else a pipe
+    std::atomic<bool> wake_pending;   // a wake-up is on its way
+
+    void acceptClients();
+    void readClient(int fd);
+    void readReady();
+    void closeClient(int fd);
+    void queueMessage(int fd, ClientState &client, const Message &msg);
+    void joinRoom(int fd, ClientState &client, Room *room);
+    void leaveRoom(ClientState &client);
+    bool flushClient(int fd, ClientState &client);
+    void flushDirty();
+    void flushIfLate();
+    void closeDoomed();
+    void drainInbox();
+    void checkStall(ClientState &client);
+    void expireTimers();
+    void setInterest(int fd, ClientState &client);
+    void applyBudget();
+    void pauseProducers(int64_t queued);
+    void resumeProducers(int64_t queued);
+
+public:
+    Shard(Server &_server, Logger &_logger, int _index, int _listen_fd, const Message &_welcome);
+    ~Shard();
+
+    // Queues msg to every member of room on this shard. read_at is when
+    // the message was read, by monotonicNs().
+    void deliver(Room *room, const Message &msg, uint64_t read_at);
+
+    // Any thread: hands message number seq to this shard. wake is false
+    // when the shard posts to itself, as it drains its inbox every loop.
+    // The copies the shard is going to queue, one per member of the room
+    // it has, count against the budget right away.
+    void post(uint64_t seq, Room *room, const Message &msg, uint64_t read_at, bool wake);
+
+    void run();
+};
+
+#endif //P2_SHARD_H
@@ -0,0 +1,145 @@
+#include "TimerWheel.h"
+
+
+TimerWheel::TimerWheel(uint64_t now) : current(now), count(0) {
+    slots[0].resize(1 << root_bits);
+    for (int level = 1; level < levels; ++level)
+        slots[level].resize(1 << level_bits);
+}
+
+
+// Shift of the slot index of a level: the ticks one slot spans.
+static int shiftOf(int level) {
+    return level ? 8 + 6 * (level - 1) : 0;
+}
+
+
+// first is the earliest tick whose slot is still to be processed: the next
+// one, or the current one while cascading into it.
+void TimerWheel::link(Timer *timer, uint64_t first) {
+    uint64_t tick = timer->expires > first ? timer->expires : first;
+    uint64_t delta = tick - current;
+
+    int level = 0;
+    while (level < levels - 1 && delta >= (uint64_t) 1 << shiftOf(level + 1))
+        level++;
+
+    size_t index;
+    if (level == 0) {
+        // Overdue timers go to the first slot.
+        index = tick & ((1 << root_bits) - 1);
+    } else {
+        uint64_t span = (uint64_t) 1 << shiftOf(levels);
+        if (delta >= span)
+            tick = current + span - 1;
+        index = (tick >> shiftOf(level)) & ((1 << level_bits) - 1);
+    }
+
+    Timer *head = &slots[level][index].head;
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+
+void TimerWheel::unlink(Timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = nullptr;
+}
+
+
+void TimerWheel::schedule(Timer *timer, uint64_t expires) {
+    if (timer->pending())
+        unlink(timer);
+    else
+        count++;
+    timer->expires = expires;
+    link(timer, current + 1);
+}
+
+
+void TimerWheel::cancel(Timer *timer) {
+    if (!timer->pending())
+        return;
+    unlink(timer);
+    count--;
+}
+
+
+// Re-files the timers of the level's current slot, all of which now fall
+// within the levels below.
+void TimerWheel::cascade(int level) {
+    size_t index = (current >> shiftOf(level)) & ((1 << level_bits) - 1);
+    Timer *head = &slots[level][index].head;
+
+    Timer list;
+    if (head->next == head)
+        return;
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = list.prev->next = &list;
+    head->next = head->prev = head;
+
+    while (list.next != &list) {
+        Timer *timer = list.next;
+        unlink(timer);
+        link(timer, current);
+    }
+}
+
+
+void TimerWheel::advance(uint64_t now, std::vector<Timer *> &expired) {
+    // Nothing to do for an empty wheel, however long it has been.
+    if (!count) {
+        current = now > current ? now : current;
+        return;
+    }
+
+    while (current < now) {
+        current++;
+
+        // At the start of a turn of a level, bring the next slot of the
+        // level above down, highest level first so that what it drops into
+        // a lower level's current slot is cascaded further too.
+        int top = 0;
+        while (top < levels - 1 && !(current & (((uint64_t) 1 << shiftOf(top + 1)) - 1)))
+            top++;
+        for (int level = top; level > 0; --level)
+            cascade(level);
+
+        Timer *head = &slots[0][current & ((1 << root_bits) - 1)].head;
+        while (head->next != head) {
+            Timer *timer = head->next;
+            unlink(timer);
+            if (timer->expires > current) {
+                // Parked in the last level for a later turn.
+                link(timer, current + 1);
+                continue;
+            }
+            count--;
+            expired.push_back(timer);
+        }
+
+        if (!count) {
+            current = now;
+            break;
+        }
+    }
+}
+
+
+int64_t TimerWheel::idleTicks(uint64_t now) const {
+    if (!count)
+        return -1;
+
+    // The first non-empty slot of the first level, or the next cascade,
+    // whichever comes first.
+    const uint64_t root_mask = (1 << root_bits) - 1;
+    uint64_t tick = current + 1;
+    while ((tick & root_mask) && slots[0][tick & root_mask].head.next == &slots[0][tick & root_mask].head)
+        tick++;
+
+    return tick > now ? (int64_t) (tick - now) : 0;
+}
@@ -0,0 +1,65 @@
+#ifndef P2_TIMERWHEEL_H
+#define P2_TIMERWHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// A timer lives inside the object it belongs to; the wheel only links it.
+struct Timer {
+    Timer *prev;
+    Timer *next;
+    uint64_t expires;  // tick
+    uintptr_t data;    // for the owner
+
+    Timer() : prev(nullptr), next(nullptr), expires(0), data(0) { }
+    bool pending() const { return prev != nullptr; }
+};
+
+
+// Hierarchical timing wheel: 256 slots of one tick, then three levels of
+// 64 slots, each slot of a level spanning a whole turn of the level below.
+// schedule() and cancel() are O(1); a timer is moved down a level at most
+// three times before it expires. Timers further out than the wheel spans
+// wait in the last level and are re-filed when they come round.
+class TimerWheel {
+    static const int levels = 4;
+    static const int root_bits = 8;
+    static const int level_bits = 6;
+
+    struct Slot {
+        Timer head;  // sentinel of a circular list
+        Slot() { head.prev = head.next = &head; }
+    };
+
+    std::vector<Slot> slots[levels];
+    uint64_t current;  // every tick up to this one has been processed
+    size_t count;
+
+    void link(Timer *timer, uint64_t first);
+    static void unlink(Timer *timer);
+    void cascade(int level);
+
+public:
+    explicit TimerWheel(uint64_t now);
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // (Re)arms timer for tick `expires`; a tick in the past fires on the
+    // next advance().
+    void schedule(Timer *timer, uint64_t expires);
+    void cancel(Timer *timer);
+
+    // Processes ticks up to now and appends the timers that expired.
+    void advance(uint64_t now, std::vector<Timer *> &expired);
+
+    // Ticks from now until advance() may have work, or -1 if no timer is
+    // pending. Exact within the first level, a lower bound beyond it.
+    int64_t idleTicks(uint64_t now) const;
+
+    size_t size() const { return count; }
+};
+
+#endif //P2_TIMERWHEEL_H
@@ -0,0 +1,506 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "FdTable.h"
+#include "Logger.h"
+#include "MessageQueue.h"
+#include "ReadRing.h"
+#include "Rooms.h"
+#include "TimerWheel.h"
+#include "gtest/gtest.h"
+
+// Unit tests of the data structures; test.py covers the server as a whole.
+
+
+static std::string text(const Message &msg) {
+    return std::string(msg.data(), msg.size());
+}
+
+
+// Every message the ring has complete.
+static std::vector<std::string> drain(ReadRing &ring) {
+    std::vector<std::string> out;
+    Message msg;
+    while (ring.next(msg))
+        out.push_back(text(msg));
+    return out;
+}
+
+
+static void put(ReadRing &ring, const std::string &data) {
+    ASSERT_EQ(data.size(), ring.write(data.data(), data.size()));
+}
+
+
+TEST(ReadRing, SplitsLines) {
+    ReadRing ring;
+    put(ring, "a\nbb\nccc");
+    EXPECT_EQ(std::vector<std::string>({"a\n", "bb\n"}), drain(ring));
+    EXPECT_EQ(3u, ring.size());
+
+    put(ring, "c\n");
+    EXPECT_EQ(std::vector<std::string>({"cccc\n"}), drain(ring));
+    EXPECT_EQ(0u, ring.size());
+}
+
+
+TEST(ReadRing, LineOfMaxMsgIsWhole) {
+    ReadRing ring;
+    std::string line = std::string(MAX_MSG - 1, 'x') + "\n";
+    put(ring, line);
+    EXPECT_EQ(std::vector<std::string>({line}), drain(ring));
+}
+
+
+TEST(ReadRing, LongLineIsCutIntoPieces) {
+    ReadRing ring;
+    std::string line(2500, 'x');
+    put(ring, line + "\n");
+
+    std::vector<std::string> pieces = drain(ring);
+    ASSERT_EQ(3u, pieces.size());
+    std::string joined;
+    for (const std::string &piece : pieces) {
+        EXPECT_LE(piece.size(), (size_t) MAX_MSG);
+        EXPECT_EQ('\n', piece.back());
+        joined += piece.substr(0, piece.size() - 1);
+    }
+    EXPECT_EQ(MAX_MSG, (int) pieces[0].size());
+    EXPECT_EQ(line, joined);
+}
+
+
+// Without a '\n', a piece goes out once MAX_MSG bytes are in, not before.
+TEST(ReadRing, LongLineWaitsForMaxMsg) {
+    ReadRing ring;
+    put(ring, std::string(MAX_MSG - 1, 'x'));
+    EXPECT_TRUE(drain(ring).empty());
+    put(ring, "y");
+    EXPECT_EQ(std::vector<std::string>({std::string(MAX_MSG - 1, 'x') + "\n"}), drain(ring));
+    EXPECT_EQ(1u, ring.size());
+    put(ring, "\n");
+    EXPECT_EQ(std::vector<std::string>({"y\n"}), drain(ring));
+}
+
+
+// A line starting at offset head of the ring memory, written in two parts
+// so that the ring is never empty and never goes back to the start. Covers
+// the '\n' at the last byte of the memory, at the first one after the wrap
+// and everywhere around, and lines cut across the wrap.
+TEST(ReadRing, LinesAcrossTheWrap) {
+    const size_t capacity = POOL_BLOCK;
+    for (size_t head = capacity - 40; head < capacity; ++head) {
+        for (size_t length : {1, 2, 30, 39, 40, 41, 80, 1023, 1024, 1500}) {
+            ReadRing ring;
+            // Filler lines up to head, then the first byte of the line.
+            for (size_t done = 0; done < head;) {
+                size_t n = std::min(head - done, (size_t) 500);
+                put(ring, std::string(n - 1, 'f') + "\n");
+                done += n;
+            }
+            put(ring, "L");
+            std::vector<std::string> filler = drain(ring);
+            ASSERT_EQ(1u, ring.size());
+            for (const std::string &line : filler)
+                ASSERT_EQ('f', line[0]);
+
+            std::string rest;
+            for (size_t i = 1; i < length; ++i)
+                rest += (char) ('a' + i % 26);
+            put(ring, rest + "\n");
+
+            std::vector<std::string> got = drain(ring);
+            std::string joined;
+            for (const std::string &piece : got) {
+                ASSERT_LE(piece.size(), (size_t) MAX_MSG);
+                ASSERT_EQ('\n', piece.back());
+                joined += piece.substr(0, piece.size() - 1);
+            }
+            ASSERT_EQ("L" + rest, joined) << "head " << head << ", length " << length;
+            ASSERT_EQ(length < MAX_MSG ? 1u : 2u, got.size()) << "head " << head << ", length " << length;
+            ASSERT_EQ(0u, ring.size());
+        }
+    }
+}
+
+
+TEST(ReadRing, WriteStopsWhenFull) {
+    ReadRing ring;
+    std::string data(POOL_BLOCK + 100, 'z');
+    EXPECT_EQ((size_t) POOL_BLOCK, ring.write(data.data(), data.size()));
+    EXPECT_EQ(0u, ring.write("z", 1));
+}
+
+
+TEST(ReadRing, FillReadsFromDescriptor) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    ASSERT_EQ(6, write(fds[1], "hi\nyo\n", 6));
+
+    ReadRing ring;
+    EXPECT_EQ(6, ring.fill(fds[0]));
+    EXPECT_EQ(std::vector<std::string>({"hi\n", "yo\n"}), drain(ring));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+// Checks that timer, alone in the wheel, fires at expires and not before.
+static void expectFiresAt(TimerWheel &wheel, Timer &timer, uint64_t from, uint64_t expires) {
+    std::vector<Timer *> expired;
+    wheel.advance(expires - 1, expired);
+    ASSERT_TRUE(expired.empty()) << "fired before " << expires - from << " ticks";
+    wheel.advance(expires, expired);
+    ASSERT_EQ(1u, expired.size()) << "not fired at " << expires - from << " ticks";
+    EXPECT_EQ(&timer, expired[0]);
+    EXPECT_FALSE(timer.pending());
+    EXPECT_EQ(0u, wheel.size());
+}
+
+
+TEST(TimerWheel, FiresOnItsTick) {
+    TimerWheel wheel(1000);
+    Timer timer;
+    wheel.schedule(&timer, 1005);
+    EXPECT_TRUE(timer.pending());
+    EXPECT_EQ(1u, wheel.size());
+    expectFiresAt(wheel, timer, 1000, 1005);
+}
+
+
+// Around every level boundary: 256 ticks for the first level, then 64
+// times as much for each one above, and past the whole wheel.
+TEST(TimerWheel, CascadesFromEveryLevel) {
+    const uint64_t starts[] = {0, 1, 255, 1000, (1 << 14) - 3};
+    const uint64_t delays[] = {1, 255, 256, 257, 300, (1 << 14) - 1, 1 << 14, (1 << 14) + 1,
+                               (1 << 20) - 1, 1 << 20, (1 << 20) + 1, (1 << 26) - 1, 1 << 26, (1 << 26) + 5};
+    for (uint64_t start : starts)
+        for (uint64_t delay : delays) {
+            if (start && delay >= 1 << 20)
+                continue;  // the slow ones once is enough
+            TimerWheel wheel(start);
+            Timer timer;
+            wheel.schedule(&timer, start + delay);
+            expectFiresAt(wheel, timer, start, start + delay);
+        }
+}
+
+
+// Cascaded timers keep firing at their own ticks, not in bunches.
+TEST(TimerWheel, CascadeKeepsOrder) {
+    TimerWheel wheel(0);
+    std::vector<Timer> timers(600);
+    for (size_t i = 0; i < timers.size(); ++i) {
+        wheel.schedule(&timers[i], 20000 + i * 7);
+    }
+
+    std::vector<Timer *> expired;
+    for (uint64_t now = 1; wheel.size(); ++now) {
+        expired.clear();
+        wheel.advance(now, expired);
+        for (Timer *timer : expired)
+            ASSERT_EQ(now, timer->expires);
+    }
+}
+
+
+TEST(TimerWheel, OverdueFiresOnNextAdvance) {
+    TimerWheel wheel(100);
+    std::vector<Timer *> expired;
+    wheel.advance(500, expired);  // empty: jumps ahead
+
+    Timer past, due;
+    wheel.schedule(&past, 50);
+    wheel.schedule(&due, 500);
+    wheel.advance(500, expired);
+    EXPECT_TRUE(expired.empty());
+    EXPECT_EQ(1, wheel.idleTicks(500));
+
+    wheel.advance(501, expired);
+    EXPECT_EQ(2u, expired.size());
+    EXPECT_EQ(0u, wheel.size());
+}
+
+
+TEST(TimerWheel, LateAdvanceFiresEverythingDue) {
+    TimerWheel wheel(0);
+    Timer near, far, later;
+    wheel.schedule(&near, 10);
+    wheel.schedule(&far, 100000);
+    wheel.schedule(&later, 300000);
+
+    std::vector<Timer *> expired;
+    wheel.advance(200000, expired);
+    EXPECT_EQ(2u, expired.size());
+    EXPECT_TRUE(later.pending());
+    expectFiresAt(wheel, later, 200000, 300000);
+}
+
+
+TEST(TimerWheel, CancelAndReschedule) {
+    TimerWheel wheel(0);
+    Timer a, b;
+    wheel.schedule(&a, 10);
+    wheel.schedule(&b, 10);
+    wheel.cancel(&a);
+    wheel.cancel(&a);
+    EXPECT_FALSE(a.pending());
+    EXPECT_EQ(1u, wheel.size());
+
+    wheel.schedule(&b, 5000);
+    EXPECT_EQ(1u, wheel.size());
+    expectFiresAt(wheel, b, 0, 5000);
+}
+
+
+TEST(TimerWheel, IdleTicks) {
+    TimerWheel wheel(0);
+    EXPECT_EQ(-1, wheel.idleTicks(0));
+
+    Timer timer;
+    wheel.schedule(&timer, 40);
+    EXPECT_EQ(40, wheel.idleTicks(0));
+    EXPECT_EQ(10, wheel.idleTicks(30));
+
+    wheel.schedule(&timer, 100000);
+    int64_t idle = wheel.idleTicks(0);
+    EXPECT_GT(idle, 0);
+    EXPECT_LE(idle, 100000);
+}
+
+
+TEST(TimerWheel, RandomTimersFireOnTime) {
+    std::mt19937_64 random(42);
+    TimerWheel wheel(0);
+    std::vector<Timer> timers(2000);
+    for (Timer &timer : timers)
+        wheel.schedule(&timer, 1 + random() % 200000);
+
+    std::vector<Timer *> expired;
+    uint64_t last = 0;
+    while (wheel.size()) {
+        uint64_t now = last + 1 + random() % 500;
+        expired.clear();
+        wheel.advance(now, expired);
+        for (Timer *timer : expired) {
+            ASSERT_GT(timer->expires, last);
+            ASSERT_LE(timer->expires, now);
+        }
+        last = now;
+    }
+    for (Timer &timer : timers)
+        EXPECT_FALSE(timer.pending());
+}
+
+
+TEST(MessageQueue, KeepsOrderAcrossBlocks) {
+    MessageQueue queue;
+    EXPECT_TRUE(queue.empty());
+    for (int i = 0; i < 2000; ++i)
+        queue.push_back(Message(std::to_string(i).c_str(), std::to_string(i).size()));
+    EXPECT_EQ(2000u, queue.size());
+    EXPECT_EQ("1234", text(queue.at(1234)));
+
+    for (int i = 0; i < 1500; ++i) {
+        ASSERT_EQ(std::to_string(i), text(queue.front()));
+        queue.pop_front();
+    }
+    EXPECT_EQ("1999", text(queue.at(499)));
+
+    MessageQueue moved(std::move(queue));
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(500u, moved.size());
+    moved.clear();
+    EXPECT_TRUE(moved.empty());
+}
+
+
+TEST(MessageQueue, SharesMessages) {
+    Message msg("shared\n", 7);
+    {
+        MessageQueue a, b;
+        a.push_back(msg);
+        b.push_back(msg);
+        EXPECT_EQ(3, msg.refs());
+    }
+    EXPECT_EQ(1, msg.refs());
+}
+
+
+TEST(FdTable, InsertFindErase) {
+    FdTable<std::string> table;
+    EXPECT_EQ(nullptr, table.find(3));
+    EXPECT_EQ(nullptr, table.find(-1));
+
+    table.insert(3) = "three";
+    table.insert(0) = "zero";
+    table.insert(5000) = "far";
+    EXPECT_EQ(3u, table.size());
+    EXPECT_EQ("three", *table.find(3));
+    EXPECT_EQ("far", *table.find(5000));
+    EXPECT_EQ(nullptr, table.find(4));
+
+    std::vector<int> order;
+    table.forEach([&order](int fd, std::string &) { order.push_back(fd); });
+    EXPECT_EQ(std::vector<int>({0, 3, 5000}), order);
+
+    std::string *three = table.find(3);
+    table.insert(4);
+    EXPECT_EQ(three, table.find(3));  // entries never move
+
+    table.erase(3);
+    table.erase(3);
+    EXPECT_EQ(nullptr, table.find(3));
+    EXPECT_EQ(3u, table.size());
+}
+
+
+static bool parse(const char *line, std::string &name) {
+    return parseRoomCommand(Message(line, strlen(line)), name);
+}
+
+
+TEST(Rooms, ParsesCommands) {
+    std::string name = "x";
+    EXPECT_TRUE(parse("/join kitchen\n", name));
+    EXPECT_EQ("kitchen", name);
+    EXPECT_TRUE(parse("/join cr\r\n", name));
+    EXPECT_EQ("cr", name);
+    EXPECT_TRUE(parse("/leave\n", name));
+    EXPECT_EQ("", name);
+
+    EXPECT_FALSE(parse("/join\n", name));
+    EXPECT_FALSE(parse("/join \n", name));
+    EXPECT_FALSE(parse("/join two words\n", name));
+    EXPECT_FALSE(parse("/join unterminated", name));
+    EXPECT_FALSE(parse("/leave now\n", name));
+    EXPECT_FALSE(parse("hello\n", name));
+    EXPECT_TRUE(parse(("/join " + std::string(MAX_ROOM_NAME, 'n') + "\n").c_str(), name));
+    EXPECT_FALSE(parse(("/join " + std::string(MAX_ROOM_NAME + 1, 'n') + "\n").c_str(), name));
+}
+
+
+TEST(Rooms, DirectoryFreesEmptyRooms) {
+    RoomDirectory rooms(2);
+    Room *lobby = rooms.lobby();
+    EXPECT_EQ(0u, lobby->id);
+    EXPECT_EQ(lobby, rooms.find(""));
+    rooms.release(lobby);
+    rooms.release(lobby);
+    EXPECT_EQ(1u, rooms.size());  // the lobby stays
+
+    Room *a = rooms.find("a");
+    EXPECT_EQ(a, rooms.find("a"));
+    EXPECT_EQ(2u, rooms.size());
+    uint32_t id = a->id;
+
+    RoomDirectory::hold(a, 2);  // as for a message posted to two loops
+    for (int i = 0; i < 3; ++i)
+        rooms.release(a);
+    EXPECT_EQ(2u, rooms.size());
+    rooms.release(a);
+    EXPECT_EQ(1u, rooms.size());
+
+    Room *b = rooms.find("b");
+    EXPECT_EQ(id, b->id);  // ids are reused, so member arrays stay small
+    EXPECT_EQ(0u, b->members[0].load());
+    rooms.release(b);
+}
+
+
+TEST(Rooms, MembersSwapIntoGaps) {
+    RoomDirectory rooms(1);
+    Room *room = rooms.find("r");
+    RoomMembers<int> members;
+
+    for (int i = 0; i < 4; ++i)
+        EXPECT_EQ((size_t) i, members.add(room, 10 + i, 0));
+    EXPECT_EQ(4u, room->members[0].load());
+
+    int *moved = members.remove(room, 1, 0);
+    ASSERT_NE(nullptr, moved);
+    EXPECT_EQ(13, *moved);  // the last one, now at index 1
+    EXPECT_EQ(nullptr, members.remove(room, 2, 0));  // the last one itself
+    EXPECT_EQ(std::vector<int>({10, 13}), std::vector<int>(members.begin(room), members.end(room)));
+    EXPECT_EQ(2u, room->members[0].load());
+
+    Room *empty = rooms.find("never joined");
+    EXPECT_EQ(members.begin(empty), members.end(empty));
+    rooms.release(empty);
+    rooms.release(room);
+}
+
+
+// Everything the logger wrote to the pipe so far.
+static std::string readAll(int fd) {
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        out.append(buf, n);
+    return out;
+}
+
+
+TEST(Logger, FormatsOnCommit) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    {
+        Logger logger(fds[1], 16, Logger::Block);
+        logger.log(Logger::Accepted);
+        logger.log(Logger::Received, Message("hi\n", 3));
+        logger.note("LOG: note\n");
+        logger.log(Logger::Terminated);
+        EXPECT_EQ("", readAll(fds[0]));
+
+        logger.commit();
+        EXPECT_EQ("LOG: accepted connection\nLOG MSG: hi\nLOG: note\nLOG: connection terminated\n",
+                  readAll(fds[0]));
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+TEST(Logger, DropsWhenFullAndSaysSo) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    {
+        Logger logger(fds[1], 4, Logger::Drop);
+        for (int i = 0; i < 10; ++i)
+            logger.log(Logger::Accepted);
+        EXPECT_EQ(6u, logger.dropped());
+
+        logger.commit();
+        std::string out = readAll(fds[0]);
+        EXPECT_EQ(4, std::count(out.begin(), out.end(), '\n') - 1);
+        EXPECT_NE(std::string::npos, out.find("LOG: 6 records dropped\n"));
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+TEST(Logger, BlockMakesRoom) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    {
+        Logger logger(fds[1], 4, Logger::Block);
+        for (int i = 0; i < 10; ++i)
+            logger.log(Logger::Accepted);
+        logger.commit();
+        std::string out = readAll(fds[0]);
+        EXPECT_EQ(10, std::count(out.begin(), out.end(), '\n'));
+        EXPECT_EQ(0u, logger.dropped());
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
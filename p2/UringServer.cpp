@@ -0,0 +1,642 @@
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <fcntl.h>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+#include "BlockPool.h"
+#include "IoUring.h"
+#include "Logger.h"
+#include "Message.h"
+#include "MessageQueue.h"
+#include "ReadRing.h"
+#include "Rooms.h"
+#include "Server.h"
+#include "TimerWheel.h"
+
+// Linux
+//
+// chatsrv on io_uring: one multishot accept for the listener, one multishot
+// recv per client filling buffers from a shared provided-buffer ring, and
+// one gathering sendmsg per recipient for everything it got in a batch of
+// completions, all queued as submission entries and handed to the kernel by
+// a single io_uring_enter per loop iteration. Queue limits, timeouts and
+// the outbound budget work as in the poller shards (Shard.cpp).
+
+
+namespace {
+
+const unsigned ring_entries = 1024;
+const unsigned recv_buffers = 1024;  // power of two
+const size_t recv_buffer_size = 4096;
+const uint16_t recv_group = 0;
+// Completions handled before the sends they queued are submitted, which
+// bounds both how long a message waits and how much a batch can queue to
+// one client before any of it can go out.
+const unsigned cqe_batch = 64;
+// Queued messages per sendmsg: as many as fit a pool block. There is one
+// send in flight per client, so it has to keep up with a fast reader alone.
+const int send_iov = (POOL_BLOCK - sizeof(struct msghdr)) / sizeof(struct iovec);
+
+// Arguments of a sendmsg in flight, in a pool block the client holds
+// while it is sending.
+struct SendArgs {
+    struct msghdr hdr;
+    struct iovec iov[send_iov];
+};
+static_assert(sizeof(SendArgs) <= POOL_BLOCK, "SendArgs does not fit a pool block");
+
+enum UringOp {
+    OpAccept = 1,
+    OpRecv,
+    OpSend,
+    OpCancel,  // of a recv, to pause a client, or of the accept
+};
+
+// One connection. The slot is only reused once no request that refers to
+// it is left in flight.
+struct UringClient {
+    int fd;  // -1 for a free slot
+    ReadRing in;
+    MessageQueue out;  // the front ones are being sent
+    size_t out_offset;
+    size_t out_bytes;  // unsent bytes in out
+    std::unique_ptr<char, BlockPool::Deleter> send_args;  // SendArgs while sending
+    bool recv_armed;
+    bool sending;
+    bool dirty;  // on the dirty list
+    bool closing;
+    Room *room;  // nullptr once closing
+    size_t room_index;
+
+    uint64_t last_active;  // tick of the last read
+    Timer idle_timer;
+    Timer stall_timer;
+
+    size_t recent_in;  // bytes read, halved every rate window
+    bool paused;       // recv cancelled while over the budget
+    uint64_t paused_at;
+    std::string held;  // received before the cancel landed, taken on resume
+};
+
+
+class UringLoop {
+    IoUring ring;
+    Server &server;
+    Logger &logger;
+    LoopMetrics &metrics;
+    int master_sock_fd;
+    bool accept_armed;
+    uint64_t accept_retry;     // tick to accept again; 0 while accepting
+    uint64_t accept_failures;  // in a row, logged at the first and the last
+    Message welcome;
+
+    std::deque<UringClient> clients;  // grows without moving the timers
+    std::vector<uint32_t> free_slots;
+    std::vector<uint32_t> dirty;   // queued to, to send once the batch is done
+    std::vector<uint32_t> doomed;  // to close once the current broadcast is over
+    RoomMembers<uint32_t> rooms;
+
+    TimerWheel wheel;
+    uint64_t now;  // tick, read once per loop iteration
+    uint64_t idle_ticks;   // 0 is off
+    uint64_t stall_ticks;
+    std::vector<Timer *> expired;
+
+    int64_t queued_delta;   // change of backlog not published yet
+    uint64_t window_start;  // tick the current rate window began
+    size_t paused_count;
+
+    static uint64_t tag(UringOp op, uint32_t slot) {
+        return (uint64_t) op << 32 | slot;
+    }
+
+    void armAccept() {
+        struct io_uring_sqe *sqe = ring.sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = master_sock_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = tag(OpAccept, 0);
+        accept_armed = true;
+    }
+
+    void armRecv(uint32_t slot) {
+        struct io_uring_sqe *sqe = ring.sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = clients[slot].fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = ring.bufferGroup();
+        sqe->user_data = tag(OpRecv, slot);
+        clients[slot].recv_armed = true;
+    }
+
+    // One send in flight per client keeps its messages in order; it takes
+    // the whole head of the queue.
+    void startSend(uint32_t slot) {
+        UringClient &c = clients[slot];
+        if (!c.send_args)
+            c.send_args.reset((char *) BlockPool::get());
+        SendArgs &args = *(SendArgs *) c.send_args.get();
+
+        int count = 0;
+        for (; count < send_iov && (size_t) count < c.out.size(); ++count) {
+            const Message &msg = c.out.at(count);
+            size_t skip = count ? 0 : c.out_offset;
+            args.iov[count].iov_base = (void *) (msg.data() + skip);
+            args.iov[count].iov_len = msg.size() - skip;
+        }
+        memset(&args.hdr, 0, sizeof(args.hdr));
+        args.hdr.msg_iov = args.iov;
+        args.hdr.msg_iovlen = count;
+
+        struct io_uring_sqe *sqe = ring.sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c.fd;
+        sqe->addr = (uint64_t) &args.hdr;
+        sqe->len = 1;
+        // More than send_iov queued: the next send follows right away.
+        sqe->msg_flags = MSG_NOSIGNAL | ((size_t) count < c.out.size() ? MSG_MORE : 0);
+        sqe->user_data = tag(OpSend, slot);
+        c.sending = true;
+    }
+
+    // Sent at the end of the batch, with whatever else the client gets. A
+    // client whose backlog would pass MAX_OUTBOUND is dropped, deferred to
+    // closeDoomed() as the room may be being iterated.
+    void queue(uint32_t slot, const Message &msg) {
+        UringClient &c = clients[slot];
+        if (c.closing)
+            return;
+        if (c.out_bytes + msg.size() > MAX_OUTBOUND) {
+            metrics.overflow_evictions.add(1);
+            doomed.push_back(slot);
+            return;
+        }
+        c.out.push_back(msg);
+        c.out_bytes += msg.size();
+        queued_delta += msg.size();
+        metrics.messages_out.add(1);
+        checkStall(c);
+        markDirty(slot);
+    }
+
+    void closeDoomed() {
+        for (uint32_t slot : doomed)
+            beginClose(slot);
+        doomed.clear();
+    }
+
+    // The stall timer runs while the backlog is over STALL_MARK.
+    void checkStall(UringClient &c) {
+        if (!stall_ticks)
+            return;
+        bool stalled = c.out_bytes > STALL_MARK;
+        if (stalled && !c.stall_timer.pending())
+            wheel.schedule(&c.stall_timer, now + stall_ticks);
+        else if (!stalled && c.stall_timer.pending())
+            wheel.cancel(&c.stall_timer);
+    }
+
+    // As in the shards: an idle timer of a client active since is pushed
+    // back rather than fired.
+    void expireTimers() {
+        expired.clear();
+        wheel.advance(now, expired);
+
+        for (Timer *timer : expired) {
+            uint32_t slot = (uint32_t) timer->data;
+            UringClient &c = clients[slot];  // closing cancels both
+
+            if (timer == &c.idle_timer) {
+                if (c.last_active + idle_ticks > now) {
+                    wheel.schedule(timer, c.last_active + idle_ticks);
+                    continue;
+                }
+                logger.note("LOG: idle connection timed out\n");
+                metrics.idle_evictions.add(1);
+            } else {
+                logger.note("LOG: stalled connection dropped\n");
+                metrics.stall_evictions.add(1);
+            }
+            beginClose(slot);
+        }
+    }
+
+    // Publishes the change of backlog and pauses or resumes readers by the
+    // same rules as Shard::applyBudget().
+    void applyBudget() {
+        int64_t queued = server.addQueued(queued_delta);
+        queued_delta = 0;
+
+        bool new_window = now - window_start >= RATE_WINDOW;
+        if (new_window) {
+            for (UringClient &c : clients)
+                c.recent_in /= 2;
+            window_start = now;
+        }
+
+        int64_t budget = server.outBudget();
+        if (!budget)
+            return;
+        if (queued > budget && (!paused_count || new_window))
+            pauseProducers(queued);
+        else if (queued <= budget / 2 && paused_count)
+            resumeProducers(queued);
+    }
+
+    void pauseProducers(int64_t queued) {
+        size_t top = 0;
+        for (UringClient &c : clients)
+            if (c.fd != -1 && !c.closing && !c.paused && c.recent_in > top)
+                top = c.recent_in;
+        if (!top)
+            return;
+
+        for (uint32_t slot = 0; slot < clients.size(); ++slot) {
+            UringClient &c = clients[slot];
+            if (c.fd == -1 || c.closing || c.paused || c.recent_in < (top + 1) / 2)
+                continue;
+
+            // Data already in flight is still taken; the multishot recv
+            // ends with -ECANCELED and is not re-armed.
+            c.paused = true;
+            c.paused_at = now;
+            paused_count++;
+            if (c.recv_armed) {
+                struct io_uring_sqe *sqe = ring.sqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = tag(OpRecv, slot);
+                sqe->user_data = tag(OpCancel, slot);
+            }
+            metrics.throttle_pauses.add(1);
+
+            char line[160];
+            snprintf(line, sizeof(line), "LOG: throttling %s: %zu bytes in recently, %lld bytes queued\n",
+                     peerName(c.fd).c_str(), c.recent_in, (long long) queued);
+            logger.note(line);
+        }
+    }
+
+    void resumeProducers(int64_t queued) {
+        for (uint32_t slot = 0; slot < clients.size(); ++slot) {
+            UringClient &c = clients[slot];
+            if (c.fd == -1 || !c.paused)
+                continue;
+
+            c.paused = false;
+            paused_count--;
+            if (!c.held.empty()) {
+                std::string held;
+                held.swap(c.held);
+                consume(slot, held.data(), held.size());
+            }
+            if (!c.recv_armed && !c.closing)
+                armRecv(slot);
+            metrics.throttle_resumes.add(1);
+
+            char line[160];
+            snprintf(line, sizeof(line), "LOG: resumed %s after %llu ms, %lld bytes queued\n",
+                     peerName(c.fd).c_str(), (unsigned long long) (now - c.paused_at) * TICK_MS,
+                     (long long) queued);
+            logger.note(line);
+        }
+    }
+
+    void markDirty(uint32_t slot) {
+        UringClient &c = clients[slot];
+        if (c.dirty)
+            return;
+        c.dirty = true;
+        dirty.push_back(slot);
+    }
+
+    // A batch is at most cqe_batch completions, which bounds how long a
+    // message waits here.
+    void flushDirty() {
+        for (uint32_t slot : dirty) {
+            UringClient &c = clients[slot];
+            c.dirty = false;
+            if (!c.closing && !c.sending && !c.out.empty())
+                startSend(slot);
+        }
+        dirty.clear();
+    }
+
+    // shutdown() ends the multishot recv and fails a pending send, so the
+    // slot drains through the normal completions.
+    void beginClose(uint32_t slot) {
+        UringClient &c = clients[slot];
+        if (c.closing)
+            return;
+        c.closing = true;
+        if (!c.sending)  // else the send in flight still points into it
+            c.out.clear();
+        queued_delta -= c.out_bytes;
+        c.out_bytes = 0;
+        wheel.cancel(&c.idle_timer);
+        wheel.cancel(&c.stall_timer);
+        if (c.paused) {
+            c.paused = false;
+            paused_count--;
+        }
+        std::string().swap(c.held);
+        leaveRoom(slot);
+        shutdown(c.fd, SHUT_RDWR);
+        finishClose(slot);
+    }
+
+    void finishClose(uint32_t slot) {
+        UringClient &c = clients[slot];
+        if (!c.closing || c.recv_armed || c.sending)
+            return;
+
+        logger.log(Logger::Terminated);
+        metrics.closes.add(1);
+
+        close(c.fd);
+        c.fd = -1;
+        c.closing = false;
+        c.in = ReadRing();
+        c.out.clear();
+        c.send_args.reset();
+        free_slots.push_back(slot);
+    }
+
+    void joinRoom(uint32_t slot, Room *room) {
+        UringClient &c = clients[slot];
+        if (c.room)
+            leaveRoom(slot);
+        c.room = room;
+        c.room_index = rooms.add(room, slot, 0);
+    }
+
+    void leaveRoom(uint32_t slot) {
+        UringClient &c = clients[slot];
+        uint32_t *moved = rooms.remove(c.room, c.room_index, 0);
+        if (moved)
+            clients[*moved].room_index = c.room_index;
+        server.releaseRoom(c.room);
+        c.room = nullptr;
+    }
+
+    void onAccept(const struct io_uring_cqe &cqe) {
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (!more)
+            accept_armed = false;
+
+        if (cqe.res < 0) {
+            int error = -cqe.res;
+            if (error == ECANCELED)
+                return;
+            if (!accept_failures++) {
+                char line[96];
+                snprintf(line, sizeof(line), "LOG: accept failed: %s, retrying\n", strerror(error));
+                logger.note(line);
+            }
+            // Out of descriptors or memory: accepting again at once would
+            // fail again at once, so the accept waits for the next tick.
+            if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+                if (more) {
+                    struct io_uring_sqe *sqe = ring.sqe();
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr = tag(OpAccept, 0);
+                    sqe->user_data = tag(OpCancel, 0);
+                }
+                accept_retry = now + 1;
+            } else if (!more) {
+                armAccept();
+            }
+            return;
+        }
+        if (!more && !accept_retry)
+            armAccept();
+        if (accept_failures) {
+            char line[96];
+            snprintf(line, sizeof(line), "LOG: accepting again after %llu retries\n",
+                     (unsigned long long) accept_failures);
+            logger.note(line);
+            accept_failures = 0;
+        }
+
+        uint32_t slot;
+        if (free_slots.empty()) {
+            slot = (uint32_t) clients.size();
+            clients.push_back(UringClient());
+        } else {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+
+        UringClient &c = clients[slot];
+        c.fd = cqe.res;
+        c.out_offset = c.out_bytes = 0;
+        c.recv_armed = c.sending = c.dirty = c.closing = c.paused = false;
+        c.room = nullptr;
+        joinRoom(slot, server.lobby());
+        c.last_active = now;
+        c.recent_in = 0;
+        c.idle_timer.data = c.stall_timer.data = slot;
+        if (idle_ticks)
+            wheel.schedule(&c.idle_timer, now + idle_ticks);
+
+        logger.log(Logger::Accepted);
+        metrics.accepts.add(1);
+
+        queue(slot, welcome);
+        armRecv(slot);
+    }
+
+    void onRecv(uint32_t slot, const struct io_uring_cqe &cqe) {
+        UringClient &c = clients[slot];
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (!more)
+            c.recv_armed = false;
+
+        if (cqe.res > 0) {
+            uint16_t bid = (uint16_t) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            const char *data = ring.buffer(bid);
+            metrics.bytes_in.add(cqe.res);
+            c.last_active = now;
+            c.recent_in += cqe.res;
+            // Buffers the kernel filled before the cancel landed would
+            // multiply into every queue just the same.
+            if (c.paused)
+                c.held.append(data, cqe.res);
+            else
+                consume(slot, data, cqe.res);
+            ring.recycleBuffer(bid);
+        }
+
+        if (c.closing)
+            finishClose(slot);
+        else if (cqe.res <= 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+            beginClose(slot);  // a hang-up closes paused clients too
+        else if (!more && !c.paused)
+            armRecv(slot);  // out of buffers, recycled since, or resumed before the cancel landed
+
+        // A flood can take many completions; stop it before the end of the
+        // batch.
+        applyBudget();
+    }
+
+    void consume(uint32_t slot, const char *data, size_t left) {
+        UringClient &c = clients[slot];
+        while (left && !c.closing) {
+            size_t n = c.in.write(data, left);
+            data += n;
+            left -= n;
+            onData(slot);
+        }
+    }
+
+    void onData(uint32_t slot) {
+        Message msg;
+        std::string room_name;
+        while (clients[slot].in.next(msg)) {
+            logger.log(Logger::Received, msg);
+            metrics.messages_in.add(1);
+
+            if (parseRoomCommand(msg, room_name)) {
+                joinRoom(slot, server.room(room_name));
+                continue;
+            }
+
+            uint64_t read_at = monotonicNs();
+            Room *room = clients[slot].room;
+            for (const uint32_t *member = rooms.begin(room); member != rooms.end(room); ++member)
+                queue(*member, msg);
+            closeDoomed();
+            metrics.fanout.record(monotonicNs() - read_at);
+            if (clients[slot].closing)  // the sender itself fell behind
+                return;
+        }
+    }
+
+    void onSend(uint32_t slot, const struct io_uring_cqe &cqe) {
+        UringClient &c = clients[slot];
+        c.sending = false;
+
+        if (cqe.res < 0) {
+            beginClose(slot);
+        } else if (!c.closing) {
+            metrics.bytes_out.add(cqe.res);
+            metrics.writes.add(1);
+            c.out_bytes -= cqe.res;
+            queued_delta -= cqe.res;
+            // Drop what went out; the last message sent may be partial.
+            size_t n = (size_t) cqe.res;
+            while (n > 0) {
+                size_t left = c.out.front().size() - c.out_offset;
+                if (n < left) {
+                    c.out_offset += n;
+                    break;
+                }
+                n -= left;
+                c.out.pop_front();
+                c.out_offset = 0;
+            }
+            if (c.out.empty())
+                c.send_args.reset();
+            else
+                markDirty(slot);
+            checkStall(c);
+        }
+        finishClose(slot);
+    }
+
+public:
+    UringLoop(Server &_server, Logger &_logger, int _master_sock_fd, const char *welcome_msg)
+            : ring(ring_entries),
+              server(_server),
+              logger(_logger),
+              metrics(_server.loopMetrics(0)),
+              master_sock_fd(_master_sock_fd),
+              accept_armed(false),
+              accept_retry(0),
+              accept_failures(0),
+              welcome(welcome_msg, strlen(welcome_msg)),
+              wheel(tickOf(monotonicNs())),
+              now(tickOf(monotonicNs())),
+              idle_ticks((uint64_t) _server.idleTimeout() * 1000 / TICK_MS),
+              stall_ticks((uint64_t) _server.stallTimeout() * 1000 / TICK_MS),
+              queued_delta(0),
+              window_start(now),
+              paused_count(0) {
+        ring.setupBuffers(recv_group, recv_buffers, recv_buffer_size);
+    }
+
+    void run() {
+        // A non-blocking listener makes accept complete with EAGAIN instead
+        // of waiting for a connection.
+        int flags = fcntl(master_sock_fd, F_GETFL, 0);
+        fcntl(master_sock_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+        armAccept();
+        while (true) {
+            // Sleep until the next timer is due, as the shards do.
+            int64_t idle = wheel.idleTicks(now);
+            int timeout = idle < 0 ? -1 : idle > INT_MAX / TICK_MS ? INT_MAX : (int) idle * TICK_MS;
+            if ((paused_count || accept_retry) && (timeout < 0 || timeout > TICK_MS))
+                timeout = TICK_MS;
+
+            ring.submit(1, timeout);
+            uint64_t woke = monotonicNs();
+            now = tickOf(woke);
+            // Once the cancelled accept has ended.
+            if (accept_retry && now >= accept_retry && !accept_armed) {
+                armAccept();
+                accept_retry = 0;
+            }
+            ring.forEachCqe([this](const struct io_uring_cqe &cqe) {
+                uint32_t slot = (uint32_t) cqe.user_data;
+                switch ((UringOp) (cqe.user_data >> 32)) {
+                    case OpAccept:
+                        onAccept(cqe);
+                        break;
+                    case OpRecv:
+                        onRecv(slot, cqe);
+                        break;
+                    case OpSend:
+                        onSend(slot, cqe);
+                        break;
+                    case OpCancel:
+                        break;
+                }
+            }, cqe_batch);
+            flushDirty();
+            expireTimers();
+            applyBudget();
+            logger.commit();
+            metrics.iteration.record(monotonicNs() - woke);
+        }
+    }
+};
+
+}
+
+
+void Server::uringLoop(int master_sock_fd) {
+    std::unique_ptr<UringLoop> loop;
+    try {
+        loop.reset(new UringLoop(*this, *logger, master_sock_fd, welcome_msg));
+    } catch (std::system_error &e) {
+        std::string note = std::string("LOG: io_uring unavailable (") + e.what() + "), using the poller\n";
+        logger->note(note.c_str());
+        return;
+    }
+    // Clients are being served from here on: an error ends the process, as
+    // it does in a shard.
+    loop->run();
+}
+
+#endif
@@ -1,7 +1,10 @@
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <tuple>
 #include <vector>
 #include <cstdlib>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <iostream>
 #include <fstream>
@@ -64,9 +67,10 @@ struct Command {
         }
     }
 
-    char **get_argv_as_c_array() {
-        std::vector<char *> cstrings;
+    std::vector<char *> cstrings;  // what get_argv_as_c_array() returns points here
 
+    char **get_argv_as_c_array() {
+        cstrings.clear();
         for (size_t i = 0; i < argv.size(); ++i)
             cstrings.push_back(const_cast<char *>(argv[i].c_str()));
         cstrings.push_back(NULL);